@@ -0,0 +1,345 @@
+#include "AnalysisScheduler.h"
+#include "AudioUtil.h"
+
+#include <QRunnable>
+#include <QThread>
+
+/*!
+\file AnalysisScheduler.cpp
+\brief AnalysisScheduler implementation file.
+*/
+
+/*
+ * For internal use only!!!  One submitted task.  The pool deletes it once it has run; a job taken back with
+ * tryTake() is deleted by the scheduler instead.
+ */
+class AnalysisScheduler::Job : public QRunnable
+{
+public:
+    Job(AnalysisScheduler *scheduler, QThreadPool *pool, const void *owner, std::function<void()> task, int priority, qint64 device)
+        : scheduler(scheduler), pool(pool), owner(owner), task(std::move(task)), priority(priority), device(device)
+    {
+        this->setAutoDelete(true);
+    }
+
+    void run() override
+    {
+        this->task();
+        this->scheduler->finished(this);
+    }
+
+    AnalysisScheduler *scheduler;
+    /* the pool the job was started on */
+    QThreadPool *pool;
+    const void *owner;
+    std::function<void()> task;
+    int priority;
+    qint64 device;
+};
+
+AnalysisScheduler::AnalysisScheduler()
+{
+    this->pool.setMaxThreadCount(QThread::idealThreadCount());
+    this->renderPool.setMaxThreadCount(ANALYSIS_RENDER_THREADS);
+    this->maxDeviceJobs = ANALYSIS_DEVICE_LIMIT;
+    AudioUtil::setHelperThreadBudget([this](int wanted) { return this->reserveHelpers(wanted); },
+                                     [this](int count) { this->releaseHelpers(count); });
+}
+
+/**
+ * \brief The scheduler shared by every WaveformWidget in the process.
+ */
+AnalysisScheduler *AnalysisScheduler::instance()
+{
+    static AnalysisScheduler scheduler;
+    return &scheduler;
+}
+
+/**
+ * \brief Sets how many jobs may run at once, across all widgets.  Defaults to QThread::idealThreadCount().
+ *
+ * The helper threads AudioUtil splits a pass over a file across are counted against the same limit; see
+ * reserveHelpers().
+ *
+ * @param count the maximum number of concurrent jobs, at least 1
+ */
+void AnalysisScheduler::setMaxThreadCount(int count)
+{
+    this->pool.setMaxThreadCount(std::max(1, count));
+}
+
+/**
+ * \brief The maximum number of jobs run at once.
+ */
+int AnalysisScheduler::maxThreadCount()
+{
+    return this->pool.maxThreadCount();
+}
+
+/**
+ * \brief Queues a task to run on the pool once no task of higher priority is waiting.
+ *
+ * @param owner the object the task works for, used by setPriority() and cancel()
+ * @param task the work to do; it runs on a pool thread
+ * @param priority larger runs sooner; tasks of equal priority run in the order they were submitted
+ * @param device the device the task reads from, as a number unique to it (such as st_dev), or ANALYSIS_NO_DEVICE
+ * for a task that is not to be counted against any device's limit
+ */
+void AnalysisScheduler::submit(const void *owner, std::function<void()> task, int priority, qint64 device)
+{
+    QMutexLocker locker(&this->mutex);
+    Job *job = new Job(this, &this->pool, owner, std::move(task), priority, device);
+    this->jobs.append(job);
+    if (device != ANALYSIS_NO_DEVICE && this->deviceJobs.value(device) >= this->maxDeviceJobs)
+    {
+        this->holdJob(job);
+    }
+    else
+    {
+        this->startJob(job);
+    }
+}
+
+/**
+ * \brief Queues a drawing task on the render pool, which runs nothing but drawing, in the order submitted.
+ *
+ * @param owner the object the task works for, used by cancel() and discard()
+ * @param task the drawing to do; it runs on a render thread
+ */
+void AnalysisScheduler::submitRender(const void *owner, std::function<void()> task)
+{
+    QMutexLocker locker(&this->mutex);
+    Job *job = new Job(this, &this->renderPool, owner, std::move(task), ANALYSIS_PRIORITY_VISIBLE, ANALYSIS_NO_DEVICE);
+    this->jobs.append(job);
+    this->renderPool.start(job, ANALYSIS_PRIORITY_VISIBLE);
+}
+
+/**
+ * \brief Sets how many jobs submitted for the same device may be handed to the pool at once.  Defaults to
+ * ANALYSIS_DEVICE_LIMIT.
+ *
+ * @param count the maximum number of jobs per device, at least 1
+ */
+void AnalysisScheduler::setDeviceLimit(int count)
+{
+    QMutexLocker locker(&this->mutex);
+    this->maxDeviceJobs = std::max(1, count);
+    for (int i = 0; i < this->heldJobs.size(); i++)
+    {
+        Job *job = this->heldJobs[i];
+        if (this->deviceJobs.value(job->device) < this->maxDeviceJobs)
+        {
+            this->heldJobs.removeAt(i--);
+            this->startJob(job);
+        }
+    }
+}
+
+/**
+ * \brief The maximum number of jobs per device handed to the pool at once.
+ */
+int AnalysisScheduler::deviceLimit()
+{
+    QMutexLocker locker(&this->mutex);
+    return this->maxDeviceJobs;
+}
+
+/**
+ * \brief Moves the queued tasks of owner to a new priority.  Tasks already running are left alone.
+ */
+void AnalysisScheduler::setPriority(const void *owner, int priority)
+{
+    QMutexLocker locker(&this->mutex);
+    for (int i = 0; i < this->jobs.size(); i++)
+    {
+        Job *job = this->jobs[i];
+        if (job->owner != owner || job->priority == priority)
+        {
+            continue;
+        }
+        if (this->heldJobs.removeOne(job))
+        {
+            job->priority = priority;
+            this->holdJob(job);
+        }
+        /* a job is only requeued if the pool has not started it yet */
+        else if (job->pool->tryTake(job))
+        {
+            job->priority = priority;
+            job->pool->start(job, priority);
+        }
+    }
+}
+
+/**
+ * \brief Drops the queued tasks of owner and waits for those already running to finish.
+ *
+ * Called by a WaveformWidget as it is destroyed, so that no task outlives the widget it works for.
+ */
+void AnalysisScheduler::cancel(const void *owner)
+{
+    QMutexLocker locker(&this->mutex);
+    this->discardQueued(owner);
+
+    for (;;)
+    {
+        bool running = false;
+        for (int i = 0; i < this->jobs.size() && !running; i++)
+        {
+            running = this->jobs[i]->owner == owner;
+        }
+        if (!running)
+        {
+            return;
+        }
+        this->jobFinished.wait(&this->mutex);
+    }
+}
+
+/**
+ * \brief Drops the queued tasks of owner without waiting for those already running.
+ *
+ * For work that has become pointless rather than unsafe, such as prefetches the user has navigated away from; a
+ * running task that should stop early has to notice that itself.
+ */
+void AnalysisScheduler::discard(const void *owner)
+{
+    QMutexLocker locker(&this->mutex);
+    this->discardQueued(owner);
+}
+
+/**
+ * \brief Lends up to wanted threads of the pool's limit to work that is about to split itself across threads of its own.
+ *
+ * Threads are only lent while no more than one job (normally the one asking) is queued on or running in the pool,
+ * and never beyond the threads the pool has free, so with several loads in flight each runs on its own thread alone.
+ * The lent threads count as busy until they are given back with releaseHelpers(), so jobs submitted in the meantime
+ * wait for them like for any other job.
+ *
+ * @param wanted the number of threads the caller would use besides its own
+ * @return the number of threads lent, between 0 and wanted
+ */
+int AnalysisScheduler::reserveHelpers(int wanted)
+{
+    QMutexLocker locker(&this->mutex);
+    int inFlight = 0;
+    for (int i = 0; i < this->jobs.size(); i++)
+    {
+        if (this->jobs[i]->pool == &this->pool && !this->heldJobs.contains(this->jobs[i]))
+        {
+            inFlight++;
+        }
+    }
+    if (inFlight > 1)
+    {
+        return 0;
+    }
+
+    int lent = std::max(0, std::min(wanted, this->pool.maxThreadCount() - this->pool.activeThreadCount()));
+    for (int i = 0; i < lent; i++)
+    {
+        this->pool.reserveThread();
+    }
+    return lent;
+}
+
+/**
+ * \brief Gives back threads lent by reserveHelpers(), once the threads using them have finished.
+ */
+void AnalysisScheduler::releaseHelpers(int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        this->pool.releaseThread();
+    }
+}
+
+/*
+ * For internal use only!!!  Takes the queued jobs of owner back from the pool and deletes them.  The mutex must be held.
+ */
+void AnalysisScheduler::discardQueued(const void *owner)
+{
+    for (int i = this->jobs.size() - 1; i >= 0; i--)
+    {
+        Job *job = this->jobs[i];
+        if (job->owner != owner)
+        {
+            continue;
+        }
+        if (this->heldJobs.removeOne(job))
+        {
+            this->jobs.removeAt(i);
+            delete job;
+        }
+        else if (job->pool->tryTake(job))
+        {
+            qint64 device = job->device;
+            this->jobs.removeAt(i);
+            delete job;
+            this->releaseDevice(device);
+        }
+    }
+}
+
+/*
+ * For internal use only!!!  Hands a job to its pool, counting it against its device.  The mutex must be held.
+ */
+void AnalysisScheduler::startJob(Job *job)
+{
+    if (job->device != ANALYSIS_NO_DEVICE)
+    {
+        this->deviceJobs[job->device]++;
+    }
+    job->pool->start(job, job->priority);
+}
+
+/*
+ * For internal use only!!!  Puts a job in line for its device, behind the held jobs of the same or higher priority.
+ * The mutex must be held.
+ */
+void AnalysisScheduler::holdJob(Job *job)
+{
+    int position = this->heldJobs.size();
+    while (position > 0 && this->heldJobs[position - 1]->priority < job->priority)
+    {
+        position--;
+    }
+    this->heldJobs.insert(position, job);
+}
+
+/*
+ * For internal use only!!!  Called when a job of device has left the pool: starts the next job held for it, if
+ * any.  The mutex must be held.
+ */
+void AnalysisScheduler::releaseDevice(qint64 device)
+{
+    if (device == ANALYSIS_NO_DEVICE)
+    {
+        return;
+    }
+    if (--this->deviceJobs[device] <= 0)
+    {
+        this->deviceJobs.remove(device);
+    }
+    for (int i = 0; i < this->heldJobs.size(); i++)
+    {
+        Job *job = this->heldJobs[i];
+        if (job->device == device)
+        {
+            this->heldJobs.removeAt(i);
+            this->startJob(job);
+            return;
+        }
+    }
+}
+
+/*
+ * For internal use only!!!  Called by a job on its pool thread once its task has returned.
+ */
+void AnalysisScheduler::finished(Job *job)
+{
+    QMutexLocker locker(&this->mutex);
+    this->jobs.removeOne(job);
+    this->releaseDevice(job->device);
+    this->jobFinished.wakeAll();
+}
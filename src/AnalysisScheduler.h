@@ -0,0 +1,95 @@
+#ifndef ANALYSISSCHEDULER_H
+#define ANALYSISSCHEDULER_H
+
+#include <functional>
+#include <algorithm>
+
+#include <QThreadPool>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+#include <QHash>
+
+/*!
+    \file AnalysisScheduler.h
+    \brief AnalysisScheduler header file
+ */
+
+#define ANALYSIS_PRIORITY_VISIBLE 1
+#define ANALYSIS_PRIORITY_HIDDEN (-1000000000)
+#define ANALYSIS_PRIORITY_PREFETCH (-1000000)
+#define ANALYSIS_PRIORITY_BATCH (ANALYSIS_PRIORITY_VISIBLE - 1)
+#define ANALYSIS_RENDER_THREADS 2
+#define ANALYSIS_NO_DEVICE (-1)
+#define ANALYSIS_DEVICE_LIMIT 2
+
+using namespace std;
+
+/*!
+\brief The thread pool every WaveformWidget loads files and computes peaks on.
+
+The pool is owned by the library rather than borrowed from QThreadPool::globalInstance(), so a window full of
+widgets cannot crowd out the rest of the application, and it runs at most maxThreadCount() jobs at a time across
+all widgets.  Queued jobs are started highest priority first: WaveformWidget uses ANALYSIS_PRIORITY_VISIBLE for
+widgets on screen and lower priorities the further a widget is from the visible part of its window, and moves its
+queued jobs up or down with setPriority() as it is scrolled.  Speculative work, such as prefetching the peaks of
+the regions next to a zoomed view, is queued at ANALYSIS_PRIORITY_PREFETCH, behind every widget that is anywhere
+near the screen.  Jobs already running are never interrupted.
+
+Drawing jobs, which rasterize a widget's waveform image, are submitted with submitRender() and run on a second,
+smaller pool of ANALYSIS_RENDER_THREADS threads, so a redraw never waits behind a long analysis.  They are otherwise
+handled like any other job: cancel() and discard() apply to them too.
+
+A job that reads a file can be submitted with the device the file is on.  At most deviceLimit() jobs per device are
+handed to the pool at a time; the rest wait, in priority and submission order, for one of them to finish, so a
+batch of loads (see WaveformWidget::setSources()) reads each disk a file or two at a time in the order it was
+submitted in, instead of seeking between all of them at once, while the pool's other threads serve other devices.
+
+AudioUtil splits some passes over a file (decoding a FULL_CACHE load in segments, band energies) across threads of
+its own.  The scheduler installs reserveHelpers() and releaseHelpers() as AudioUtil's helper thread budget (see
+AudioUtil::setHelperThreadBudget()), which lends threads out of the pool's limit only while the pool has nothing
+else to do, so those threads never push the threads working on files past maxThreadCount().  The one exception is
+the reader thread each sequential pass overlaps its decoding with: it is not counted, so with several loads in
+flight up to one reader per running load may run on top of the limit.
+*/
+class AnalysisScheduler
+{
+
+public:
+        static AnalysisScheduler *instance();
+        void setMaxThreadCount(int count);
+        int maxThreadCount();
+        void submit(const void *owner, std::function<void()> task, int priority, qint64 device = ANALYSIS_NO_DEVICE);
+        void submitRender(const void *owner, std::function<void()> task);
+        void setDeviceLimit(int count);
+        int deviceLimit();
+        void setPriority(const void *owner, int priority);
+        void cancel(const void *owner);
+        void discard(const void *owner);
+        int reserveHelpers(int wanted);
+        void releaseHelpers(int count);
+
+private:
+        class Job;
+
+        AnalysisScheduler();
+        void finished(Job *job);
+        void discardQueued(const void *owner);
+        void startJob(Job *job);
+        void holdJob(Job *job);
+        void releaseDevice(qint64 device);
+
+        QThreadPool pool;
+        QThreadPool renderPool;
+        /* guards jobs; a job stays listed, and so alive, until it has run or been taken back from the pool */
+        QMutex mutex;
+        QWaitCondition jobFinished;
+        QList<Job *> jobs;
+        /* jobs waiting for their device, highest priority first; they are in jobs too, but not in a pool */
+        QList<Job *> heldJobs;
+        /* per device, the jobs handed to the pool and not finished yet */
+        QHash<qint64, int> deviceJobs;
+        int maxDeviceJobs;
+};
+
+#endif // ANALYSISSCHEDULER_H
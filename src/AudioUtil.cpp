@@ -1,10 +1,39 @@
 #include "AudioUtil.h"
+#include "MathUtil.h"
+
+#include <QFile>
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
 /*!
 \file AudioUtil.cpp
 \brief AudioUtil implementation file.
 */
 
+std::mutex AudioUtil::registryMutex;
+vector<AudioUtil*> AudioUtil::registry;
+std::atomic<size_t> AudioUtil::totalBytes(0);
+std::atomic<size_t> AudioUtil::memoryBudget(DEFAULT_MEMORY_BUDGET);
+std::atomic<unsigned long long> AudioUtil::viewClock(0);
+std::atomic<bool> AudioUtil::sharedPeakStoreEnabled(false);
+std::mutex AudioUtil::helperBudgetMutex;
+std::function<int(int)> AudioUtil::reserveHelperBudget;
+std::function<void(int)> AudioUtil::releaseHelperBudget;
+
 /**
  * \brief Default constructor.
  *
@@ -14,9 +43,7 @@
  */
 AudioUtil::AudioUtil()
 {
-        this->sfinfo = new SF_INFO;
-        this->fileHandlingMode = DISK_MODE;
-        sndFileNotEmpty = false;
+        this->init();
 }
 
 /**
@@ -29,16 +56,60 @@ AudioUtil::AudioUtil()
 */
 AudioUtil::AudioUtil(QString filePath)
 {
+        this->init();
         this->setFile(filePath);
 }
 
+/*
+ * Shared by both constructors: sets up an instance with no file and enters it in the memory accounting registry.
+ */
+void AudioUtil::init()
+{
+        this->sfinfo = new SF_INFO;
+        this->fileHandlingMode = DISK_MODE;
+        autoMode = false;
+        sndFileNotEmpty = false;
+        peaksValid = false;
+        spectralColumns = 0;
+        peakResolution = 16;
+        samplesPerBlock = PEAK_BLOCK_FRAMES;
+        peaksImported = false;
+        blockData = NULL;
+        blockDataValues = 0;
+        blockResolution = 16;
+        blockFrames = PEAK_BLOCK_FRAMES;
+        kernels = PeakKernels::select(0, 0);
+        sndFile = NULL;
+        sndFileDescriptor = -1;
+        intervalPeaksReady = false;
+        statisticsReady = false;
+        pooledReaders = 0;
+        cancelRequested = false;
+        framesProcessed = 0;
+        lastReportedProgress = -1;
+        accountedBytes = 0;
+        externalBytes = 0;
+        evictableBytes = 0;
+        lastViewed = viewClock++;
+        evictionPending = false;
+
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.push_back(this);
+}
+
 
 /*
  * Clean up heap-allocated objects.
  */
 AudioUtil::~AudioUtil()
 {
-    if(sndFileNotEmpty == true)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.erase(std::find(registry.begin(), registry.end(), this));
+        totalBytes -= this->accountedBytes;
+    }
+    this->closeReaders();
+    if(sndFileNotEmpty == true && this->sndFile != NULL)
     {
         sf_close(this->sndFile);
     }
@@ -54,21 +125,322 @@ AudioUtil::~AudioUtil()
  *  into memory when asked to analyze or return this region (when the peakForRegion, getAllFrames and 
  *  grabFrame function are invoked, for example).  This keeps memory use minimal, but has an immense
  *  consequence with respect to performance.  Upon being set to FULL_CACHE mode, an AudioUtil instance will
- *  load the entire audio file that it wraps into memory (storing it as a vector of double-precision floating
- *  point values), and use this cached data to perform the operations that, in DISK_MODE, require that 
+ *  load the entire audio file that it wraps into memory (storing it as double-precision floating point values,
+ *  one contiguous plane per channel), and use this cached data to perform the operations that, in DISK_MODE, require that 
  *  data be loaded dynamically from disk for processing.  In FULL_CACHE mode, you get drastically increased performance, but 
- *  pay a penalty in increased memory consumption.
+ *  pay a penalty in increased memory consumption.  Switching to DISK_MODE releases the cache.
+ *
+ *  In \link AudioUtil::AUTO \endlink mode, the instance picks FULL_CACHE if the cache for the wrapped file fits in
+ *  what remains of the memory budget shared by all AudioUtil instances (see setMemoryBudget()), and DISK_MODE
+ *  otherwise.  The choice is made again every time a file is set; getFileHandlingMode() reports the mode picked.
+ *
+ *  In \link AudioUtil::PEAKS_ONLY \endlink mode, the instance streams the file once and keeps nothing but the minimum
+ *  and maximum of each channel over every block of getSamplesPerBlock() frames, quantized to 8 or 16 bits (see
+ *  setPeakResolution()).  The decoder is then closed and no sample data is retained, so the memory held is a tiny
+ *  fraction of FULL_CACHE's.  peakForRegion() and calculateNormalizedPeaks() are answered from the blocks, at block
+ *  resolution; grabFrame(), getAllFrames() and bandEnergiesForColumns() need the samples and return empty vectors.
  * 
  *  @param mode  file-handling scheme for the AudioUtil instance.  Valid options: \link AudioUtil::DISK_MODE \endlink, \link 
- *  AudioUtil::FULL_CACHE \endlink
+ *  AudioUtil::FULL_CACHE \endlink, \link AudioUtil::AUTO \endlink, \link AudioUtil::PEAKS_ONLY \endlink
  */
 void AudioUtil::setFileHandlingMode(FileHandlingMode mode)
 {
+    if(this->peaksImported)
+    {
+        /* there is no audio behind imported peaks to fall back on */
+        return;
+    }
+    this->autoMode = mode == AUTO;
     this->fileHandlingMode = mode;
-    if(mode == FULL_CACHE)
+    if(this->autoMode)
+    {
+        this->resolveAutoMode();
+    }
+    if(this->fileHandlingMode != PEAKS_ONLY)
+    {
+        this->clearBlockPeaks();
+        if(this->sndFileNotEmpty && this->sndFile == NULL && !this->reopenDecoder())
+        {
+            return;
+        }
+    }
+    if(this->fileHandlingMode == PEAKS_ONLY)
+    {
+        this->closeReaders();
+        vector<double>().swap(this->fileCache);
+        this->spectralBands.clear();
+        this->spectralColumns = 0;
+        this->evictionPending = false;
+        if(this->sndFileNotEmpty && this->sndFile != NULL)
+        {
+            this->computeBlockPeaks();
+        }
+        this->updateMemoryUsage();
+    }
+    else if(this->fileHandlingMode == FULL_CACHE)
     {
         this->fileCache.clear();
         this->populateCache();
+        this->updateMemoryUsage();
+        enforceMemoryBudget(this);
+    }
+    else
+    {
+        vector<double>().swap(this->fileCache);
+        this->spectralBands.clear();
+        this->spectralColumns = 0;
+        this->evictionPending = false;
+        this->updateMemoryUsage();
+    }
+}
+
+/*
+ * For internal use only!!!  In AUTO mode, picks FULL_CACHE or DISK_MODE for the wrapped file from the size of its
+ * cache and the memory budget left.  With no file set, DISK_MODE is used until there is one.
+ */
+void AudioUtil::resolveAutoMode()
+{
+    this->fileHandlingMode = DISK_MODE;
+    if (!this->sndFileNotEmpty)
+    {
+        return;
+    }
+
+    size_t cacheBytes = (size_t) this->sfinfo->frames * this->sfinfo->channels * sizeof(double);
+    size_t used = totalBytes - std::min((size_t) totalBytes, (size_t) this->accountedBytes);
+    size_t budget = memoryBudget;
+    if (used <= budget && cacheBytes <= budget - used)
+    {
+        this->fileHandlingMode = FULL_CACHE;
+    }
+}
+
+/**
+ * \brief Number of bytes held by this instance: its sample cache and analysis results, plus any external usage
+ * reported with setExternalMemoryUsage().
+ */
+size_t AudioUtil::memoryUsage()
+{
+    return this->accountedBytes;
+}
+
+/**
+ * \brief Adds memory held on this instance's behalf elsewhere (a widget's pixmap, for example) to its accounting.
+ * @param bytes the external usage, replacing any previously reported figure
+ */
+void AudioUtil::setExternalMemoryUsage(size_t bytes)
+{
+    this->externalBytes = bytes;
+    this->updateMemoryUsage();
+}
+
+/**
+ * \brief Records that the data of this instance has just been displayed.  Least recently viewed instances are
+ * the first asked to release their caches under memory pressure.
+ */
+void AudioUtil::markViewed()
+{
+    this->lastViewed = ++viewClock;
+}
+
+/**
+ * \brief Sets the function called when this instance should release its cache to relieve memory pressure.
+ *
+ * The handler is called with the registry lock held, from whichever thread pushed usage over the budget, so it
+ * should do nothing more than arrange for setFileHandlingMode(DISK_MODE) to be called on this instance by the thread
+ * that owns it.  Instances without a handler are never asked to release their caches.
+ *
+ * @param handler the function to call, or an empty function to opt out of eviction
+ */
+void AudioUtil::setEvictionHandler(std::function<void()> handler)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    this->evictionHandler = handler;
+}
+
+/**
+ * \brief Sets the number of bytes that all instances of AudioUtil together should stay within.
+ *
+ * The budget steers AUTO mode, and when it is exceeded the least recently viewed instances are asked to release
+ * their caches (see setEvictionHandler()).  The default is DEFAULT_MEMORY_BUDGET.
+ */
+void AudioUtil::setMemoryBudget(size_t bytes)
+{
+    memoryBudget = bytes;
+    enforceMemoryBudget(NULL);
+}
+
+/**
+ * \brief The memory budget shared by all instances of AudioUtil.
+ */
+size_t AudioUtil::getMemoryBudget()
+{
+    return memoryBudget;
+}
+
+/**
+ * \brief Shares PEAKS_ONLY analysis between processes through a POSIX shared-memory store.  Disabled by default.
+ *
+ * While enabled, an instance entering PEAKS_ONLY mode first looks for the blocks of its file, at its block size and
+ * resolution, in the store (see SharedPeakStore).  If another process, or another instance in this one, has
+ * published them, they are mapped read-only and used in place, and the file is not decoded at all; if it is still
+ * analyzing the file, the instance waits for it.  Otherwise the instance analyzes the file and publishes the
+ * blocks for everyone else, then uses the published copy itself.  Mapped blocks are shared by every process that
+ * maps them, and are not counted against the memory budget: the store has a budget of its own (see
+ * setSharedPeakStoreBudget()).
+ *
+ * Imported peak data (importPeaks(), importPeakData()) is never published.
+ */
+void AudioUtil::setSharedPeakStoreEnabled(bool enabled)
+{
+    sharedPeakStoreEnabled = enabled;
+}
+
+/**
+ * \brief Whether PEAKS_ONLY analysis is shared between processes.  See setSharedPeakStoreEnabled().
+ */
+bool AudioUtil::isSharedPeakStoreEnabled()
+{
+    return sharedPeakStoreEnabled;
+}
+
+/**
+ * \brief Sets the number of bytes of shared memory the shared peak store may hold for this user.
+ *
+ * Entries are kept in RAM until they are unlinked, so whenever this process publishes a new one, the least recently
+ * used entries are unlinked until the store fits the budget again.  The default is DEFAULT_SHARED_PEAKS_BUDGET.
+ */
+void AudioUtil::setSharedPeakStoreBudget(size_t bytes)
+{
+    SharedPeakStore::setBudget(bytes);
+}
+
+/**
+ * \brief Sets where the threads some passes over a file are split across (decoding a FULL_CACHE load in segments,
+ * band energies) are taken from.
+ *
+ * Before such a pass starts its threads, it calls reserve with the number it would use besides its own, and uses
+ * only as many as reserve returns; once they have finished, it hands the same number back to release.  This lets
+ * an application count them against a thread limit of its own, as WaveformWidget does with its AnalysisScheduler.
+ * Until a budget is set, or after it is cleared with empty functions, every thread asked for is used.  The reader
+ * thread of a sequential pass, which mostly waits on the file, is never counted.
+ *
+ * @param reserve given the number of threads wanted, returns the number that may be used, between 0 and it
+ * @param release given the number of threads reserve returned, once they are done
+ */
+void AudioUtil::setHelperThreadBudget(std::function<int(int)> reserve, std::function<void(int)> release)
+{
+    std::lock_guard<std::mutex> lock(helperBudgetMutex);
+    reserveHelperBudget = reserve;
+    releaseHelperBudget = release;
+}
+
+/**
+ * \brief Unlinks every entry of the shared peak store made by this user.
+ *
+ * Instances that have an entry mapped keep using it; the memory is returned once the last of them lets it go.
+ */
+void AudioUtil::purgeSharedPeakStore()
+{
+    SharedPeakStore::purge();
+}
+
+/*
+ * For internal use only!!!  Takes up to wanted threads out of the helper thread budget and sets release to the
+ * function that gives them back, so a budget set in the meantime is not handed threads it never lent.
+ */
+int AudioUtil::reserveHelpers(int wanted, std::function<void(int)> &release)
+{
+    std::function<int(int)> reserve;
+    {
+        std::lock_guard<std::mutex> lock(helperBudgetMutex);
+        reserve = reserveHelperBudget;
+        release = releaseHelperBudget;
+    }
+    if (!release)
+    {
+        release = [](int) {};
+    }
+    if (!reserve || wanted <= 0)
+    {
+        return std::max(0, wanted);
+    }
+    return std::max(0, std::min(wanted, reserve(wanted)));
+}
+
+/**
+ * \brief Number of bytes held by all instances of AudioUtil together.
+ */
+size_t AudioUtil::totalMemoryUsage()
+{
+    return totalBytes;
+}
+
+/*
+ * For internal use only!!!  Recomputes the bytes held by this instance and folds the change into the global total.
+ */
+void AudioUtil::updateMemoryUsage()
+{
+    size_t spectralBytes;
+    {
+        std::lock_guard<std::mutex> lock(this->spectralMutex);
+        spectralBytes = this->spectralBands.capacity() * sizeof(double);
+    }
+    size_t summaryBytes = this->intervalPeaksReady ? this->intervalPeaks.capacity() * sizeof(double) : 0;
+    summaryBytes += this->statisticsReady ? this->statisticsBlocks.capacity() * sizeof(BlockStatistics) : 0;
+    size_t bytes = this->fileCache.capacity() * sizeof(double)
+                 + this->blockPeaks8.capacity() * sizeof(int8_t)
+                 + this->blockPeaks16.capacity() * sizeof(int16_t)
+                 + this->peaks.capacity() * sizeof(double)
+                 + spectralBytes + summaryBytes
+                 + this->externalBytes;
+    this->evictableBytes = this->fileCache.capacity() * sizeof(double) + spectralBytes;
+    size_t previous = this->accountedBytes.exchange(bytes);
+    totalBytes += bytes;
+    totalBytes -= previous;
+}
+
+/*
+ * For internal use only!!!  While the total is over budget, asks the least recently viewed instances (other than
+ * the requester) that hold a cache and have an eviction handler to release it.
+ */
+void AudioUtil::enforceMemoryBudget(AudioUtil *requester)
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    /* bytes already promised by evictions that have not happened yet */
+    size_t pending = 0;
+    for (unsigned int i = 0; i < registry.size(); i++)
+    {
+        if (registry[i]->evictionPending)
+        {
+            pending += registry[i]->evictableBytes;
+        }
+    }
+
+    while (totalBytes > memoryBudget + pending)
+    {
+        AudioUtil *victim = NULL;
+        for (unsigned int i = 0; i < registry.size(); i++)
+        {
+            AudioUtil *candidate = registry[i];
+            if (candidate == requester || candidate->evictionPending || !candidate->evictionHandler
+                || candidate->evictableBytes == 0)
+            {
+                continue;
+            }
+            if (victim == NULL || candidate->lastViewed < victim->lastViewed)
+            {
+                victim = candidate;
+            }
+        }
+        if (victim == NULL)
+        {
+            return;
+        }
+        victim->evictionPending = true;
+        pending += victim->evictableBytes;
+        victim->evictionHandler();
     }
 }
 
@@ -95,13 +467,10 @@ AudioUtil::FileHandlingMode AudioUtil::getFileHandlingMode()
 bool AudioUtil::setFile(QString filePath)
 {
 
-    if(sndFileNotEmpty == true)
-    {
-        sf_close(this->sndFile);
-    }
-    this->sfinfo->format=0;
-        if (! (this->sndFile = sf_open (filePath.toStdString().c_str(), SFM_READ, this->sfinfo)))
+    this->closeFile();
+        if (! (this->sndFile = openReader(filePath, this->sfinfo, &this->sndFileDescriptor)))
         {
+                this->sndFile = NULL;
                 /* Open failed so print an error message. */
                 fprintf (stderr, "failed to open input file \"%s\".\n", filePath.toStdString().c_str()) ;
                 /* Print the error message fron libsndfile. */
@@ -109,438 +478,2231 @@ bool AudioUtil::setFile(QString filePath)
                 return false;
         };
 
-        /* turn on normalization  */
-        sf_command (this->sndFile, SFC_SET_NORM_DOUBLE, NULL, SF_TRUE) ;
-
         /*channel num check! */
-        if (this->sfinfo->channels > MAX_CHANNELS)
+        if (this->sfinfo->channels < 1)
         {
-            fprintf (stderr, "Error.  Input has too many channels.  Maximum channels: %d channels\n", MAX_CHANNELS) ;
+            fprintf (stderr, "Error.  Input has no channels.\n") ;
+            sf_close(this->sndFile);
+            this->sndFile = NULL;
+            this->sndFileDescriptor = -1;
             return false;
         };
 
+        this->srcFilePath = filePath;
+        this->sndFileNotEmpty = true;
+        this->selectKernels();
+
+        if(this->autoMode)
+        {
+            this->resolveAutoMode();
+        }
         if(this->fileHandlingMode == FULL_CACHE)
         {
-            this->fileCache.clear();
-            this->fileCache = this->getAllFrames();
+            this->populateCache();
+        }
+        else if(this->fileHandlingMode == PEAKS_ONLY)
+        {
+            this->computeBlockPeaks();
         }
+        this->updateMemoryUsage();
+        enforceMemoryBudget(this);
 
-        this->sndFileNotEmpty = true;
 	return true;
 }
 
 /**
- * \brief Calculates peak values for the normalized audio data of the audio file wrapped by an instance of AudioUtil.
+ * For internal use only!!!  Opens a read handle on the given file with double normalization turned on, filling
+ * in the SF_INFO structure passed to it.  Returns NULL if the file could not be opened.
  *
+ * The file is opened here and handed to libsndfile with sf_open_fd(), so the descriptor is known and page-cache
+ * advice can be given on it; it is stored in descriptor if that is given, and closed along with the handle.  With
+ * IOPolicy::directIO the open is tried with O_DIRECT first.  libsndfile reads through unaligned buffers, which most
+ * filesystems refuse under O_DIRECT, so a direct handle is only kept if a first read through it succeeds; otherwise
+ * the file is opened normally.  If the file cannot be opened here at all, libsndfile is left to open it by path.
  *
- * @return a vector containing the peak for each channel of the audio file wrapped by an instance of AudioUtil.
- * in the case of an error, an empty vector is returned.
+ * libsndfile owns the descriptor from the moment it is passed to sf_open_fd(), and closes it itself when the open
+ * fails.  It must not be closed here again: readers are opened on many threads at once, and the number may already
+ * belong to a file another thread has just opened.
  */
-vector<double> AudioUtil::calculateNormalizedPeaks()
+SNDFILE *AudioUtil::openReader(QString filePath, SF_INFO *info, int *descriptor)
 {
-        double *peaksPtr = (double *) malloc(2*sizeof(double));
-        if (sndFile != NULL)
-        {
-            this->peaks.clear();
-
-
+    SNDFILE *file = NULL;
+    int fd = -1;
+    std::string path = filePath.toStdString();
 
-            sf_command (sndFile, SFC_CALC_NORM_MAX_ALL_CHANNELS, peaksPtr, sizeof(double)*this->getNumChannels()) ;
-
-            if(this->getNumChannels() == 2)
+#ifdef O_DIRECT
+    if (this->ioPolicy.directIO && (fd = open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC)) != -1)
+    {
+        info->format = 0;
+        if ((file = sf_open_fd(fd, SFM_READ, info, SF_TRUE)) != NULL)
+        {
+            /* a short probe read: direct I/O either works from the start or not at all */
+            vector<double> probe((size_t) 4096 * std::max(1, info->channels));
+            sf_count_t expected = std::min((sf_count_t) 4096, info->frames);
+            if (sf_readf_double(file, probe.data(), expected) < expected || sf_seek(file, 0, SEEK_SET) == -1)
             {
-                   this->peaks.push_back(peaksPtr[0]);
-                   this->peaks.push_back((peaksPtr[1]));
+                sf_close(file);
+                file = NULL;
             }
-            else if (this->getNumChannels() == 1)
-            {
-                this->peaks.push_back(peaksPtr[0]);
-            } else
+        }
+        if (file == NULL)
         {
-            perror("Error in AudioUtil::calculateNormalizedPeaks()\n");
+            fd = -1;
         }
+    }
+#endif
 
-            free(peaksPtr);
+    if (file == NULL && (fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) != -1)
+    {
+        info->format = 0;
+        if ((file = sf_open_fd(fd, SFM_READ, info, SF_TRUE)) == NULL)
+        {
+            fd = -1;
         }
+    }
 
-        return peaks;
-}
+    if (file == NULL)
+    {
+        info->format = 0;
+        file = sf_open(path.c_str(), SFM_READ, info);
+    }
 
+    if (file != NULL)
+    {
+        /* turn on normalization  */
+        sf_command (file, SFC_SET_NORM_DOUBLE, NULL, SF_TRUE) ;
+    }
+    if (descriptor != NULL)
+    {
+        *descriptor = file != NULL ? fd : -1;
+    }
+    return file;
+}
 
 /**
- * \brief The number of channels of the wrapped audio file.
+ * \brief Sets how the wrapped file is read.
  *
- *  @return the number of channels in the audio file wrapped by an instance of AudioUtil 
+ * The defaults suit most uses: reads of READ_BLOCK_FRAMES frames, and sequential-access advice to the kernel for
+ * whole-file passes, so it reads ahead aggressively.  Setting dropCacheAfterScan asks the kernel to drop the file's
+ * pages once a full pass (cache population or analysis) is done with it, so that scanning a large library does not
+ * push the working set of other programs out of the page cache; later DISK_MODE queries then read from the device
+ * again.  directIO bypasses the page cache altogether where the filesystem and libsndfile allow it (see
+ * openReader()), and silently falls back to a normal open where they do not.
+ *
+ * Like setFileHandlingMode(), this must not be called concurrently with other calls on the instance.  The policy
+ * applies to handles opened from then on; set it before setFile() for it to cover the first pass.
+ *
+ * @param policy the I/O policy; readBlockFrames is raised to at least 1
  */
-int AudioUtil::getNumChannels()
+void AudioUtil::setIOPolicy(const IOPolicy &policy)
 {
-        if (sfinfo != NULL)
-        {
-                return this->sfinfo->channels;
-        }
-        else
-        {
-                return NULL;
-        }
+    this->ioPolicy = policy;
+    this->ioPolicy.readBlockFrames = std::max(1, policy.readBlockFrames);
 }
 
 /**
- * \brief The sample rate of the wrapped audio file.
- * 
- *  @return the sample rate of the audio file wrapped by an instance of AudioUtil
+ * \brief The I/O policy of an instance of AudioUtil.  See setIOPolicy().
  */
-int AudioUtil::getSampleRate()
+AudioUtil::IOPolicy AudioUtil::getIOPolicy()
 {
-        return this->sfinfo->samplerate;
+    return this->ioPolicy;
 }
 
-
-/*!
-\brief The total number of frames of the wrapped audio file.
-@return the number of frames of the wrapped audio file.
-*/
-int AudioUtil::getTotalFrames()
+/**
+ * \brief Finds where a file lies on disk, so that a batch of files can be read in an order that keeps seeks short.
+ *
+ * Sorting FileLocation values groups files by device, and on each device by the physical offset of their first
+ * extent, which on Linux is asked of the filesystem with the FIEMAP ioctl.  Where that is not supported (network
+ * filesystems, among others) the offset is 0 and files fall back to inode order, which most filesystems allocate
+ * roughly in step with the disk.  Only metadata is read; the file's contents are not touched.
+ *
+ * @param filePath the file to locate
+ * @return its location, with valid set to false if it could not be found
+ */
+AudioUtil::FileLocation AudioUtil::locateFile(QString filePath)
 {
-    if (sfinfo != NULL)
+    FileLocation location;
+    std::string path = filePath.toStdString();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd == -1 || fstat(fd, &status) == -1)
     {
-            return this->sfinfo->frames;
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return location;
     }
-    else
+    location.valid = true;
+    location.device = (uint64_t) status.st_dev;
+    location.inode = (uint64_t) status.st_ino;
+
+#ifdef FS_IOC_FIEMAP
+    /* the first extent is enough: a file is read from its start */
+    uint64_t request[(sizeof(struct fiemap) + sizeof(struct fiemap_extent) + 7) / 8];
+    memset(request, 0, sizeof(request));
+    struct fiemap *map = (struct fiemap *) request;
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0 && !(map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
     {
-            return NULL;
+        location.physicalOffset = map->fm_extents[0].fe_physical;
+    }
+#endif
+    close(fd);
+    return location;
+}
+
+/*
+ * For internal use only!!!  Advises the kernel that the given frames are about to be read in order.  The byte
+ * range is estimated in proportion to the file's size, which is exact for PCM and close enough for anything else.
+ */
+void AudioUtil::adviseScan(int descriptor, sf_count_t startFrame, sf_count_t frameCount)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+    struct stat status;
+    sf_count_t totalFrames = this->sfinfo->frames;
+    if (!this->ioPolicy.adviseSequential || descriptor == -1 || totalFrames <= 0 || fstat(descriptor, &status) == -1)
+    {
+        return;
     }
+    off_t offset = (off_t) ((double) status.st_size * startFrame / totalFrames);
+    off_t length = (off_t) ((double) status.st_size * frameCount / totalFrames) + 1;
+    posix_fadvise(descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(descriptor, offset, length, POSIX_FADV_WILLNEED);
+#else
+    (void) descriptor;
+    (void) startFrame;
+    (void) frameCount;
+#endif
 }
 
+/*
+ * For internal use only!!!  Called once a whole-file pass is done with the file: drops it from the page cache if
+ * the I/O policy asks for that.
+ */
+void AudioUtil::adviseDone(int descriptor)
+{
+#ifdef POSIX_FADV_DONTNEED
+    if (this->ioPolicy.dropCacheAfterScan && descriptor != -1)
+    {
+        posix_fadvise(descriptor, 0, 0, POSIX_FADV_DONTNEED);
+    }
+#else
+    (void) descriptor;
+#endif
+}
 
-/** 
- * \brief Get a given frame of the wrapped audio file.
- *
- * Function to get the frame at a given index in the audio file wrapped by an instance of AudioUtil. 
- * Will return a double-precision floating point vector of dimension equal to the number_of_channels in the wrapped file 
- * (either 1 or 2) containing the data of the requested frame.  In the case that a frame is requested which is out of 
- * bounds, an error message will be printed and an empty vector returned.
+/**
+ * \brief Calculates peak values for the normalized audio data of the audio file wrapped by an instance of AudioUtil.
  *
- * @param frameIndex The desired frame. 
+ * The peaks are a by-product of the analysis pass over the file: in FULL_CACHE mode they are gathered while the cache
+ * is populated, and in DISK_MODE a single sequential pass is made the first time they are asked for.  Either way they
+ * are stored with the instance, so repeated calls never go back to the disk.
  *
- * @return A vector of double-precision floating point values representing the contents of the requested frame.  In 
- * the case that an out-of-bounds frame is requested, an empty vector will be returned. 
+ * @return a vector containing the peak for each channel of the audio file wrapped by an instance of AudioUtil.
+ * in the case of an error, an empty vector is returned.
  */
-vector<double> AudioUtil::grabFrame(int frameIndex)
+vector<double> AudioUtil::calculateNormalizedPeaks()
 {
-    vector<double> frameData;
+        if (this->peaksValid)
+        {
+            return peaks;
+        }
 
-    if(this->fileHandlingMode == FULL_CACHE)
-    {
-        if(this->getNumChannels() == 1)
+        /* only the first caller makes the analysis pass; any others wait for it and share the result */
+        std::lock_guard<std::mutex> lock(this->analysisMutex);
+        if (this->sndFileNotEmpty && !this->peaksValid && this->fileHandlingMode != PEAKS_ONLY)
         {
-            if(frameIndex >= (int) this->fileCache.size())
-            {
-                perror("err in AudioUtil::grabFrame -- caller attempting to access out-of-range frame\n");
+            this->analyzeFile();
+        }
+
+        return peaks;
+}
+
+/**
+ * For internal use only!!!  Makes one sequential pass over the wrapped file through the instance's own handle,
+ * storing the per-channel peaks of the normalized data.  The same pass builds the interval peaks: the peak of each
+ * channel over every PEAK_INTERVAL_FRAMES frames, which lets DISK_MODE region queries skip reading whole intervals,
+ * and the statistics blocks used by statisticsForRange().
+ */
+void AudioUtil::analyzeFile()
+{
+    int channels = this->getNumChannels();
+    vector<double> channelPeaks(channels, 0.0);
+    vector<double> intervals;
+    intervals.reserve((size_t) ((this->sfinfo->frames + PEAK_INTERVAL_FRAMES - 1) / PEAK_INTERVAL_FRAMES) * channels);
+    vector<BlockStatistics> statistics;
+    statistics.reserve((size_t) ((this->sfinfo->frames + STATISTICS_BLOCK_FRAMES - 1) / STATISTICS_BLOCK_FRAMES) * channels);
+    sf_count_t scanned = 0;
+
+    Reader *reader = this->acquireReader();
+    if (reader == NULL || !this->seekReader(reader, 0))
+    {
+        fprintf(stderr, "seek failed in AudioUtil::analyzeFile() function\n");
+        this->releaseReader(reader);
+        return;
+    }
+
+    this->resetProgress();
+    this->adviseScan(reader->descriptor, 0, this->sfinfo->frames);
+    /* every buffer but the last holds whole intervals */
+    sf_count_t bufferFrames = PEAK_INTERVAL_FRAMES * std::max(1, this->ioPolicy.readBlockFrames / PEAK_INTERVAL_FRAMES);
+    bool completed = this->pipelinedScan(bufferFrames, [this, reader](double *dest, sf_count_t frames)
+    {
+        return this->readReader(reader, dest, frames);
+    },
+    [&](const double *frames, sf_count_t frameCount)
+    {
+        for (sf_count_t start = 0; start < frameCount; start += PEAK_INTERVAL_FRAMES)
+        {
+            sf_count_t count = std::min((sf_count_t) PEAK_INTERVAL_FRAMES, frameCount - start);
+            this->kernels->accumulatePeaks(frames + start * channels, count, channels, channelPeaks.data());
+
+            size_t first = intervals.size();
+            intervals.resize(first + channels, 0.0);
+            this->kernels->foldRegionPeak(frames + start * channels, count, channels, &intervals[first]);
+        }
+        this->accumulateBlockStatistics(frames, scanned, frameCount, statistics);
+        scanned += frameCount;
+        this->reportProgress(frameCount);
+        return !this->cancelRequested;
+    });
+
+    this->adviseDone(reader->descriptor);
+    this->releaseReader(reader);
+    if (!completed)
+    {
+        return;
+    }
+
+    this->peaks = channelPeaks;
+    this->intervalPeaks = intervals;
+    this->intervalPeaksReady = true;
+    this->statisticsBlocks.swap(statistics);
+    this->statisticsReady = true;
+    this->peaksValid = true;
+    this->updateMemoryUsage();
+}
+
+/*
+ * For internal use only!!!  Waits for the other side of a pipelinedScan() queue: a few yields first, since the
+ * other thread is usually about to catch up, then short sleeps so a slow disk does not keep a core spinning.
+ */
+static void pipelineBackoff(int &spins)
+{
+    if (++spins < 64)
+    {
+        std::this_thread::yield();
+    }
+    else
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+/**
+ * For internal use only!!!  Makes one sequential pass with decoding and reduction overlapped, so a pass takes about
+ * as long as the slower of the two instead of their sum.
+ *
+ * A reader thread fills PIPELINE_BUFFERS reusable, cache-line-aligned buffers of bufferFrames frames each through
+ * read, and hands them over a lock-free queue to the calling thread, which folds each into its results with reduce
+ * and hands it back over a second queue.  read may return short counts; every buffer but the last is filled
+ * completely, so reduce can rely on whole multiples of bufferFrames.  There is a single reducer, because the cache,
+ * the interval peaks and the blocks are all built in file order.  The pass stops early when reduce returns false or a
+ * cancel is requested.  Returns true if the whole file was read and reduced.
+ *
+ * The reader thread is not counted against the helper thread budget (see setHelperThreadBudget()): it spends most
+ * of its time waiting on the file, and the pass needs it to overlap at all, so a pass runs on two threads even when
+ * the budget has none to spare.
+ */
+bool AudioUtil::pipelinedScan(sf_count_t bufferFrames, std::function<sf_count_t(double *, sf_count_t)> read, std::function<bool(const double *, sf_count_t)> reduce)
+{
+    struct Filled
+    {
+        int buffer;
+        sf_count_t frames;
+    };
+
+    int channels = this->getNumChannels();
+    /* 8 doubles to a 64-byte cache line: the stride keeps every buffer aligned once the first one is */
+    size_t stride = ((size_t) bufferFrames * channels + 7) & ~(size_t) 7;
+    vector<double> storage(stride * PIPELINE_BUFFERS + 8);
+    double *base = storage.data() + ((64 - ((uintptr_t) storage.data() & 63)) & 63) / sizeof(double);
+
+    /* each queue can hold every buffer, so a write to either never has to wait */
+    RingBuffer<int> freeBuffers(PIPELINE_BUFFERS);
+    RingBuffer<Filled> filledBuffers(PIPELINE_BUFFERS);
+    for (int i = 0; i < PIPELINE_BUFFERS; i++)
+    {
+        freeBuffers.write(&i, 1);
+    }
+    std::atomic<bool> stop(false);
+
+    std::thread reader([&]()
+    {
+        int spins = 0;
+        int buffer;
+        while (!stop)
+        {
+            if (freeBuffers.read(&buffer, 1) == 0)
+            {
+                pipelineBackoff(spins);
+                continue;
+            }
+            spins = 0;
+
+            double *dest = base + buffer * stride;
+            Filled filled = {buffer, 0};
+            while (filled.frames < bufferFrames && !stop && !this->cancelRequested)
+            {
+                sf_count_t got = read(dest + filled.frames * channels, bufferFrames - filled.frames);
+                if (got <= 0)
+                {
+                    break;
+                }
+                filled.frames += got;
+            }
+            filledBuffers.write(&filled, 1);
+
+            /* a short buffer marks the end of the file */
+            if (filled.frames < bufferFrames)
+            {
+                return;
+            }
+        }
+    });
+
+    bool completed = false;
+    int spins = 0;
+    Filled filled;
+    for (;;)
+    {
+        if (filledBuffers.read(&filled, 1) == 0)
+        {
+            pipelineBackoff(spins);
+            continue;
+        }
+        spins = 0;
+
+        if (filled.frames > 0 && !reduce(base + filled.buffer * stride, filled.frames))
+        {
+            break;
+        }
+        if (filled.frames < bufferFrames)
+        {
+            completed = true;
+            break;
+        }
+        freeBuffers.write(&filled.buffer, 1);
+    }
+
+    stop = true;
+    reader.join();
+    return completed && !this->cancelRequested;
+}
+
+/**
+ * \brief Whether interval peaks are available for DISK_MODE region queries.
+ *
+ * The interval peaks are the peak of each channel over every PEAK_INTERVAL_FRAMES frames.  A region query takes the
+ * intervals lying wholly inside the region from them, and reads only the partial intervals at either end from the
+ * file; those reads still seek through libsndfile, which keeps no decoder checkpoints of its own.  A region
+ * narrower than an interval is therefore read entirely from the file, so zoomed-in views of compressed files (MP3,
+ * Vorbis, Opus) gain nothing from them and still pay for libsndfile's seek on every query.  The interval
+ * peaks are built by the first full pass over the file: the cache population in FULL_CACHE mode, or the analysis
+ * pass calculateNormalizedPeaks() makes in DISK_MODE.  They are kept in memory with the rest of the analysis until
+ * another file is set, and are neither exported with the peak data nor shared through the shared peak store.
+ */
+bool AudioUtil::hasIntervalPeaks()
+{
+    return this->intervalPeaksReady;
+}
+
+/*
+ * For internal use only!!!  Whether the wrapped file is in a compressed format, for which libsndfile may have to
+ * decode from a distant sync point to honour a seek.
+ *
+ * sndfile.h declares its formats in an enum, which the preprocessor cannot test for, and the Opus, MPEG and ALAC
+ * subtypes only appeared between libsndfile 1.0.26 and 1.1.0.  They are matched by value, so the library still builds
+ * against older versions, which simply never report them.
+ */
+bool AudioUtil::isCompressedFormat()
+{
+    switch (this->sfinfo->format & SF_FORMAT_SUBMASK)
+    {
+        case SF_FORMAT_VORBIS:
+        case 0x0064: /* SF_FORMAT_OPUS */
+        case 0x0070: /* SF_FORMAT_ALAC_16 */
+        case 0x0071: /* SF_FORMAT_ALAC_20 */
+        case 0x0072: /* SF_FORMAT_ALAC_24 */
+        case 0x0073: /* SF_FORMAT_ALAC_32 */
+        case 0x0080: /* SF_FORMAT_MPEG_LAYER_I */
+        case 0x0081: /* SF_FORMAT_MPEG_LAYER_II */
+        case 0x0082: /* SF_FORMAT_MPEG_LAYER_III */
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * For internal use only!!!  Positions a pooled handle at the given frame.  The handle's position is tracked, so
+ * nothing is done if it is already there, and for compressed formats a short distance forward is covered by
+ * decoding and discarding frames rather than by a seek.
+ */
+bool AudioUtil::seekReader(Reader *reader, sf_count_t frame)
+{
+    if (frame == reader->position)
+    {
+        return true;
+    }
+
+    if (reader->position >= 0 && frame > reader->position
+        && frame - reader->position <= SEEK_FORWARD_READ_LIMIT && this->isCompressedFormat())
+    {
+        int channels = this->getNumChannels();
+        static thread_local vector<double> discard;
+        discard.resize((size_t) this->ioPolicy.readBlockFrames * channels);
+        while (reader->position < frame)
+        {
+            sf_count_t request = std::min((sf_count_t) this->ioPolicy.readBlockFrames, frame - reader->position);
+            sf_count_t got = sf_readf_double(reader->file, discard.data(), request);
+            if (got <= 0)
+            {
+                break;
+            }
+            reader->position += got;
+        }
+        if (reader->position == frame)
+        {
+            return true;
+        }
+    }
+
+    if (sf_seek(reader->file, frame, SEEK_SET) == -1)
+    {
+        reader->position = -1;
+        return false;
+    }
+    reader->position = frame;
+    return true;
+}
+
+/*
+ * For internal use only!!!  Reads from a pooled handle, keeping track of its position.
+ */
+sf_count_t AudioUtil::readReader(Reader *reader, double *dest, sf_count_t frameCount)
+{
+    sf_count_t got = sf_readf_double(reader->file, dest, frameCount);
+    if (got > 0 && reader->position >= 0)
+    {
+        reader->position += got;
+    }
+    return got;
+}
+
+/*
+ * For internal use only!!!  Borrows a handle from the pool, opening a new one if none is idle and the pool is not
+ * full, and otherwise waiting for one to be released.  Returns NULL if the file could not be opened.
+ */
+AudioUtil::Reader *AudioUtil::acquireReader()
+{
+    std::unique_lock<std::mutex> lock(this->readerMutex);
+    while (this->idleReaders.empty() && this->pooledReaders >= MAX_POOLED_READERS)
+    {
+        this->readerAvailable.wait(lock);
+    }
+    if (!this->idleReaders.empty())
+    {
+        Reader *reader = this->idleReaders.back();
+        this->idleReaders.pop_back();
+        return reader;
+    }
+    this->pooledReaders++;
+    lock.unlock();
+
+    SF_INFO info;
+    int descriptor;
+    SNDFILE *file = this->openReader(this->srcFilePath, &info, &descriptor);
+    if (file == NULL)
+    {
+        lock.lock();
+        this->pooledReaders--;
+        this->readerAvailable.notify_one();
+        return NULL;
+    }
+    Reader *reader = new Reader;
+    reader->file = file;
+    reader->position = 0;
+    reader->descriptor = descriptor;
+    return reader;
+}
+
+/*
+ * For internal use only!!!  Returns a handle borrowed with acquireReader() to the pool.
+ */
+void AudioUtil::releaseReader(Reader *reader)
+{
+    if (reader == NULL)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(this->readerMutex);
+    this->idleReaders.push_back(reader);
+    this->readerAvailable.notify_one();
+}
+
+/*
+ * For internal use only!!!  Closes every pooled handle.  No handle may be borrowed at the time.
+ */
+void AudioUtil::closeReaders()
+{
+    std::lock_guard<std::mutex> lock(this->readerMutex);
+    for (unsigned int i = 0; i < this->idleReaders.size(); i++)
+    {
+        sf_close(this->idleReaders[i]->file);
+        delete this->idleReaders[i];
+    }
+    this->pooledReaders -= (int) this->idleReaders.size();
+    this->idleReaders.clear();
+}
+
+/*
+ * For internal use only!!!  DISK_MODE implementation of peakForRegion(): reads the region through a pooled handle,
+ * in blocks of IOPolicy::readBlockFrames frames of the file's native sample type, into a scratch buffer private to the
+ * calling thread.
+ */
+vector<double> AudioUtil::peakFromDisk(Reader *reader, int region_start_frame, int region_end_frame)
+{
+    int channels = this->getNumChannels();
+    vector<double> regionPeaks;
+    if (region_end_frame <= region_start_frame)
+    {
+        return regionPeaks;
+    }
+
+    if (!this->seekReader(reader, region_start_frame))
+    {
+        perror("seek error in AudioUtil::peakForRegion function\n");
+        return regionPeaks;
+    }
+
+    regionPeaks.assign(channels, 0.0);
+    sf_count_t remaining = region_end_frame - region_start_frame;
+    while (remaining > 0)
+    {
+        sf_count_t got = this->kernels->readRegionPeak(reader->file, std::min((sf_count_t) this->ioPolicy.readBlockFrames, remaining), channels, regionPeaks.data());
+        if (got <= 0)
+        {
+            break;
+        }
+        reader->position += reader->position >= 0 ? got : 0;
+        remaining -= got;
+    }
+
+    if (remaining == region_end_frame - region_start_frame)
+    {
+        perror("read error in AudioUtil::peakForRegion function\n");
+        regionPeaks.clear();
+    }
+    return regionPeaks;
+}
+
+/*
+ * For internal use only!!!  DISK_MODE implementation of peakForRegion() when interval peaks are available: whole
+ * intervals inside the region are taken from them, and only the partial intervals at either end are read.
+ */
+vector<double> AudioUtil::peakFromIntervalPeaks(Reader *reader, int region_start_frame, int region_end_frame)
+{
+    int channels = this->getNumChannels();
+    sf_count_t firstInterval = (region_start_frame + PEAK_INTERVAL_FRAMES - 1) / PEAK_INTERVAL_FRAMES;
+    sf_count_t endInterval = std::min((sf_count_t) region_end_frame / PEAK_INTERVAL_FRAMES, (sf_count_t) (this->intervalPeaks.size() / channels));
+    if (firstInterval >= endInterval)
+    {
+        return this->peakFromDisk(reader, region_start_frame, region_end_frame);
+    }
+
+    /* the pieces are folded in file order, so ties between equal magnitudes go the same way as a straight read */
+    vector<double> regionPeaks(channels, 0.0);
+    vector<double> edge;
+    if (region_start_frame < firstInterval * PEAK_INTERVAL_FRAMES)
+    {
+        edge = this->peakFromDisk(reader, region_start_frame, (int) (firstInterval * PEAK_INTERVAL_FRAMES));
+        if (!edge.empty())
+        {
+            this->kernels->foldRegionPeak(edge.data(), 1, channels, regionPeaks.data());
+        }
+    }
+    this->kernels->foldRegionPeak(&this->intervalPeaks[firstInterval * channels], endInterval - firstInterval, channels, regionPeaks.data());
+    if (endInterval * PEAK_INTERVAL_FRAMES < region_end_frame)
+    {
+        edge = this->peakFromDisk(reader, (int) (endInterval * PEAK_INTERVAL_FRAMES), region_end_frame);
+        if (!edge.empty())
+        {
+            this->kernels->foldRegionPeak(edge.data(), 1, channels, regionPeaks.data());
+        }
+    }
+    return regionPeaks;
+}
+
+/**
+ * For internal use only!!!  Computes the PEAKS_ONLY blocks with analyzeBlocks(), unless the shared peak store is
+ * enabled and already has them.  With the store enabled, blocks computed here are published to it and the
+ * instance switches to the published copy.  The statistics blocks travel with them, and are copied out of the store
+ * unless this instance already has its own.
+ */
+void AudioUtil::computeBlockPeaks()
+{
+    int channels = this->getNumChannels();
+    /* the settings are read once, so the blocks, the store entry and the recorded settings all agree */
+    int bits = this->peakResolution;
+    int framesPerBlock = this->samplesPerBlock;
+    this->clearBlockPeaks();
+    size_t statisticsCount = (size_t) ((this->sfinfo->frames + STATISTICS_BLOCK_FRAMES - 1) / STATISTICS_BLOCK_FRAMES) * channels;
+    if (!sharedPeakStoreEnabled || !this->sharedPeaks.acquire(this->srcFilePath, channels, this->sfinfo->frames, framesPerBlock,
+                                                              bits, statisticsCount,
+                                                              [this]() { return (bool) this->cancelRequested; }))
+    {
+        this->analyzeBlocks(bits, framesPerBlock);
+        return;
+    }
+
+    if (this->sharedPeaks.isReady())
+    {
+        const double *channelPeaks = this->sharedPeaks.channelPeaks();
+        this->peaks.assign(channelPeaks, channelPeaks + channels);
+        this->blockData = this->sharedPeaks.values();
+        this->blockDataValues = this->sharedPeaks.valueCount();
+        this->blockResolution = bits;
+        this->blockFrames = framesPerBlock;
+        this->peaksValid = true;
+        if (!this->statisticsReady)
+        {
+            const BlockStatistics *statistics = this->sharedPeaks.statistics();
+            this->statisticsBlocks.assign(statistics, statistics + this->sharedPeaks.statisticsCount());
+            this->statisticsReady = true;
+        }
+
+        /* nothing will be read: release the decoder, as analyzeBlocks() does */
+        sf_close(this->sndFile);
+        this->sndFile = NULL;
+        this->sndFileDescriptor = -1;
+        return;
+    }
+
+    /* a file that decodes to fewer frames than it claims is kept to this instance */
+    if (!this->analyzeBlocks(bits, framesPerBlock) || this->blockDataValues != this->sharedPeaks.valueCount()
+        || this->statisticsBlocks.size() != this->sharedPeaks.statisticsCount())
+    {
+        this->sharedPeaks.abandon();
+        return;
+    }
+    if (this->sharedPeaks.publish(this->peaks.data(), this->blockData, this->statisticsBlocks.data()))
+    {
+        vector<int8_t>().swap(this->blockPeaks8);
+        vector<int16_t>().swap(this->blockPeaks16);
+        this->blockData = this->sharedPeaks.values();
+    }
+}
+
+/**
+ * For internal use only!!!  Streams the wrapped file once, keeping the minimum and maximum of every channel, quantized
+ * to bits, over each block of framesPerBlock frames, along with the per-channel peaks and, unless they are already there,
+ * the statistics blocks.  The decoder is then closed.  Returns false if the pass did not complete.  The blocks must
+ * have been cleared beforehand.
+ */
+bool AudioUtil::analyzeBlocks(int bits, int framesPerBlock)
+{
+    int channels = this->getNumChannels();
+    vector<double> channelPeaks(channels, 0.0);
+    vector<int> minMax(channels * 2);
+    bool buildStatistics = !this->statisticsReady;
+    vector<BlockStatistics> statistics;
+    sf_count_t scanned = 0;
+
+    size_t expectedValues = (size_t) ((this->sfinfo->frames + framesPerBlock - 1) / framesPerBlock) * channels * 2;
+    if (bits == 8)
+    {
+        this->blockPeaks8.reserve(expectedValues);
+    }
+    else
+    {
+        this->blockPeaks16.reserve(expectedValues);
+    }
+
+    if (sf_seek(this->sndFile, 0, SEEK_SET) == -1)
+    {
+        fprintf(stderr, "seek failed in AudioUtil::analyzeBlocks() function\n");
+        return false;
+    }
+
+    this->resetProgress();
+    this->adviseScan(this->sndFileDescriptor, 0, this->sfinfo->frames);
+    /* every buffer but the last holds whole blocks */
+    sf_count_t bufferFrames = (sf_count_t) framesPerBlock * std::max(1, this->ioPolicy.readBlockFrames / framesPerBlock);
+    SNDFILE *file = this->sndFile;
+    bool completed = this->pipelinedScan(bufferFrames, [file](double *dest, sf_count_t frames)
+    {
+        return sf_readf_double(file, dest, frames);
+    },
+    [&](const double *frames, sf_count_t frameCount)
+    {
+        this->kernels->accumulatePeaks(frames, frameCount, channels, channelPeaks.data());
+        for (sf_count_t start = 0; start < frameCount; start += framesPerBlock)
+        {
+            sf_count_t count = std::min((sf_count_t) framesPerBlock, frameCount - start);
+            this->kernels->quantizeBlock(frames + start * channels, count, channels, bits, minMax.data());
+            for (int i = 0; i < channels * 2; i++)
+            {
+                if (bits == 8)
+                {
+                    this->blockPeaks8.push_back((int8_t) minMax[i]);
+                }
+                else
+                {
+                    this->blockPeaks16.push_back((int16_t) minMax[i]);
+                }
+            }
+        }
+        if (buildStatistics)
+        {
+            this->accumulateBlockStatistics(frames, scanned, frameCount, statistics);
+            scanned += frameCount;
+        }
+        this->reportProgress(frameCount);
+        this->sharedPeaks.renew();
+        return !this->cancelRequested;
+    });
+    if (!completed)
+    {
+        return false;
+    }
+
+    this->blockPeaks8.shrink_to_fit();
+    this->blockPeaks16.shrink_to_fit();
+    this->useStoredBlocks(bits, framesPerBlock);
+    this->peaks = channelPeaks;
+    this->peaksValid = true;
+    if (buildStatistics)
+    {
+        statistics.shrink_to_fit();
+        this->statisticsBlocks.swap(statistics);
+        this->statisticsReady = true;
+    }
+
+    /* nothing more will be read: release the decoder and its buffers */
+    this->adviseDone(this->sndFileDescriptor);
+    sf_close(this->sndFile);
+    this->sndFile = NULL;
+    this->sndFileDescriptor = -1;
+    return true;
+}
+
+/*
+ * For internal use only!!!  Fills values with the (min, max) pairs of every channel, quantized to bits, over every
+ * block of framesPerBlock frames.  In PEAKS_ONLY mode the stored blocks are used as they are, and bits and
+ * framesPerBlock are set to the settings they were built with; otherwise they are computed from the cache or, in
+ * DISK_MODE, from a pooled handle.
+ */
+bool AudioUtil::quantizedBlocks(vector<int> &values, int &bits, int &framesPerBlock)
+{
+    int channels = this->getNumChannels();
+    values.clear();
+
+    if (this->fileHandlingMode == PEAKS_ONLY)
+    {
+        bits = this->blockResolution;
+        framesPerBlock = this->blockFrames;
+        if (bits == 8)
+        {
+            const int8_t *data = (const int8_t *) this->blockData;
+            values.assign(data, data + this->blockDataValues);
+        }
+        else
+        {
+            const int16_t *data = (const int16_t *) this->blockData;
+            values.assign(data, data + this->blockDataValues);
+        }
+        return true;
+    }
+
+    vector<int> minMax(channels * 2);
+    if (this->fileHandlingMode == FULL_CACHE)
+    {
+        sf_count_t cachedFrames = this->cacheFrames();
+        for (sf_count_t start = 0; start < cachedFrames; start += framesPerBlock)
+        {
+            for (int c = 0; c < channels; c++)
+            {
+                PlanarKernels::quantize(this->cachePlane(c) + start, std::min((sf_count_t) framesPerBlock, cachedFrames - start), bits, &minMax[2 * c]);
+            }
+            values.insert(values.end(), minMax.begin(), minMax.end());
+        }
+        return true;
+    }
+
+    Reader *reader = this->acquireReader();
+    if (reader == NULL || !this->seekReader(reader, 0))
+    {
+        this->releaseReader(reader);
+        return false;
+    }
+    vector<double> chunk((size_t) framesPerBlock * channels);
+    sf_count_t framesRead;
+    while ((framesRead = this->readReader(reader, chunk.data(), framesPerBlock)) > 0)
+    {
+        this->kernels->quantizeBlock(chunk.data(), framesRead, channels, bits, minMax.data());
+        values.insert(values.end(), minMax.begin(), minMax.end());
+    }
+    this->releaseReader(reader);
+    return true;
+}
+
+/**
+ * \brief Writes the peak analysis of the wrapped file in one of the formats of BBC audiowaveform.
+ *
+ * A path ending in ".json" gets audiowaveform's JSON format; anything else gets its binary .dat format (version 1
+ * for mono files, version 2 otherwise).  Each point covers getSamplesPerBlock() frames and holds the minimum and
+ * maximum of every channel at getPeakResolution() bits.  In PEAKS_ONLY mode the stored blocks are written as they
+ * are, with the block size and resolution they were computed with; in the other modes they are computed from the
+ * cache or the file.
+ *
+ * @param filePath path of the file to write
+ * @return true if the file was written, false otherwise
+ */
+bool AudioUtil::exportPeaks(QString filePath)
+{
+    if (!this->sndFileNotEmpty)
+    {
+        return false;
+    }
+
+    QByteArray peakData = this->exportPeakData(filePath.endsWith(".json", Qt::CaseInsensitive));
+    QFile file(filePath);
+    if (peakData.isEmpty() || !file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        fprintf(stderr, "failed to write peak file \"%s\".\n", filePath.toStdString().c_str());
+        return false;
+    }
+    return file.write(peakData) == peakData.size();
+}
+
+/**
+ * \brief The peak analysis of the wrapped file, in audiowaveform's JSON or binary .dat format.  See exportPeaks().
+ *
+ * @param json true for the JSON format, false for the binary format
+ * @return the encoded peak data, or an empty array if there is nothing to export
+ */
+QByteArray AudioUtil::exportPeakData(bool json)
+{
+    vector<int> values;
+    int channels = this->getNumChannels();
+    int bits = this->peakResolution;
+    int framesPerBlock = this->samplesPerBlock;
+    if (!this->sndFileNotEmpty || channels <= 0 || !this->quantizedBlocks(values, bits, framesPerBlock))
+    {
+        return QByteArray();
+    }
+    int length = (int) (values.size() / (2 * channels));
+    int version = channels == 1 ? 1 : 2;
+
+    if (json)
+    {
+        QJsonArray data;
+        for (unsigned int i = 0; i < values.size(); i++)
+        {
+            data.append(values[i]);
+        }
+        QJsonObject root;
+        root["version"] = version;
+        root["channels"] = channels;
+        root["sample_rate"] = this->getSampleRate();
+        root["samples_per_pixel"] = framesPerBlock;
+        root["bits"] = bits;
+        root["length"] = length;
+        root["data"] = data;
+        return QJsonDocument(root).toJson(QJsonDocument::Compact);
+    }
+
+    QByteArray peakData;
+    QDataStream out(&peakData, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::LittleEndian);
+    out << (qint32) version;
+    out << (quint32) (bits == 8 ? 1 : 0);
+    out << (qint32) this->getSampleRate();
+    out << (qint32) framesPerBlock;
+    out << (quint32) length;
+    if (version == 2)
+    {
+        out << (qint32) channels;
+    }
+    for (unsigned int i = 0; i < values.size(); i++)
+    {
+        if (bits == 8)
+        {
+            out << (qint8) values[i];
+        }
+        else
+        {
+            out << (qint16) values[i];
+        }
+    }
+    return peakData;
+}
+
+/**
+ * \brief Wraps precomputed peak data in audiowaveform's binary .dat (version 1 or 2) or JSON format.
+ *
+ * No audio is decoded, or even needed: the instance is put in PEAKS_ONLY mode with the imported points as its
+ * blocks, and reports the channel count, sample rate and (approximate) length they describe.  It stays in
+ * PEAKS_ONLY mode until another file is set.
+ *
+ * @param filePath path to a .dat or .json peak file
+ * @return true if the peak data was loaded, false otherwise
+ */
+bool AudioUtil::importPeaks(QString filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        fprintf(stderr, "failed to open peak file \"%s\".\n", filePath.toStdString().c_str());
+        return false;
+    }
+    return this->importPeakData(file.readAll());
+}
+
+/**
+ * \brief Like importPeaks(), but for peak data already in memory (fetched over the network, for example).
+ *
+ * The format is detected from the content: data starting with '{' is read as JSON, anything else as .dat.
+ *
+ * @param peakData the contents of a .dat or .json peak file
+ * @return true if the peak data was loaded, false otherwise
+ */
+bool AudioUtil::importPeakData(const QByteArray &peakData)
+{
+    int version = 0;
+    int channels = 1;
+    int sampleRate = 0;
+    int framesPerPoint = 0;
+    int bits = 16;
+    qint64 length = 0;
+    vector<int> values;
+
+    if (peakData.trimmed().startsWith('{'))
+    {
+        QJsonObject root = QJsonDocument::fromJson(peakData).object();
+        version = root.value("version").toInt();
+        channels = root.value("channels").toInt(1);
+        sampleRate = root.value("sample_rate").toInt();
+        framesPerPoint = root.value("samples_per_pixel").toInt();
+        bits = root.value("bits").toInt(16);
+        length = root.value("length").toInt();
+        QJsonArray data = root.value("data").toArray();
+        if ((bits == 8 || bits == 16) && channels > 0 && length > 0 && length <= INT64_MAX / 4 / channels
+            && (qint64) data.size() == length * channels * 2)
+        {
+            values.reserve(data.size());
+            for (int i = 0; i < data.size(); i++)
+            {
+                values.push_back(data.at(i).toInt());
+            }
+        }
+    }
+    else
+    {
+        QDataStream in(peakData);
+        in.setByteOrder(QDataStream::LittleEndian);
+        qint32 fileVersion, fileSampleRate, fileFramesPerPoint, fileChannels = 1;
+        quint32 flags, fileLength;
+        in >> fileVersion >> flags >> fileSampleRate >> fileFramesPerPoint >> fileLength;
+        if (fileVersion == 2)
+        {
+            in >> fileChannels;
+        }
+        version = fileVersion;
+        channels = fileChannels;
+        sampleRate = fileSampleRate;
+        framesPerPoint = fileFramesPerPoint;
+        bits = (flags & 1) ? 8 : 16;
+        length = fileLength;
+
+        /* the header is not trusted: nothing is allocated until the payload it describes is known to be there */
+        qint64 available = peakData.size() - in.device()->pos();
+        if (in.status() == QDataStream::Ok && channels > 0 && length > 0 && length <= INT64_MAX / 4 / channels
+            && length * channels * 2 * (bits / 8) == available)
+        {
+            values.reserve((size_t) length * channels * 2);
+            for (qint64 i = 0; i < length * channels * 2 && in.status() == QDataStream::Ok; i++)
+            {
+                if (bits == 8)
+                {
+                    qint8 value;
+                    in >> value;
+                    values.push_back(value);
+                }
+                else
+                {
+                    qint16 value;
+                    in >> value;
+                    values.push_back(value);
+                }
+            }
+            if (in.status() != QDataStream::Ok)
+            {
+                values.pop_back();
+            }
+        }
+    }
+
+    if ((version != 1 && version != 2) || (bits != 8 && bits != 16) || channels <= 0 || length <= 0
+        || framesPerPoint <= 0 || sampleRate <= 0 || length > INT64_MAX / 4 / channels
+        || (qint64) values.size() != length * channels * 2)
+    {
+        fprintf(stderr, "Error.  Invalid or truncated peak data.\n");
+        return false;
+    }
+
+    this->closeFile();
+    this->fileHandlingMode = PEAKS_ONLY;
+    this->autoMode = false;
+    this->peakResolution = bits;
+    this->samplesPerBlock = framesPerPoint;
+    this->sfinfo->channels = channels;
+    this->sfinfo->samplerate = sampleRate;
+    this->sfinfo->frames = length * framesPerPoint;
+    this->sfinfo->format = 0;
+    this->sfinfo->seekable = 0;
+    this->selectKernels();
+
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        if (bits == 8)
+        {
+            this->blockPeaks8.push_back((int8_t) values[i]);
+        }
+        else
+        {
+            this->blockPeaks16.push_back((int16_t) values[i]);
+        }
+    }
+    this->useStoredBlocks(bits, framesPerPoint);
+
+    this->peaks.assign(channels, 0.0);
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        int channel = (int) ((i / 2) % channels);
+        this->peaks[channel] = std::max(this->peaks[channel], fabs(this->blockValue(i)));
+    }
+
+    this->peaksValid = true;
+    this->peaksImported = true;
+    this->sndFileNotEmpty = true;
+    this->updateMemoryUsage();
+    return true;
+}
+
+/*
+ * For internal use only!!!  Closes the wrapped file and drops everything derived from it.
+ */
+void AudioUtil::closeFile()
+{
+    this->closeReaders();
+    if(sndFileNotEmpty == true && this->sndFile != NULL)
+    {
+        sf_close(this->sndFile);
+    }
+    this->sndFile = NULL;
+    this->sndFileDescriptor = -1;
+    this->sndFileNotEmpty = false;
+    vector<double>().swap(this->fileCache);
+    this->clearBlockPeaks();
+    this->peaksImported = false;
+    this->evictionPending = false;
+    this->peaks.clear();
+    this->peaksValid = false;
+    this->spectralBands.clear();
+    this->spectralColumns = 0;
+    this->intervalPeaks.clear();
+    this->intervalPeaksReady = false;
+    vector<BlockStatistics>().swap(this->statisticsBlocks);
+    this->statisticsReady = false;
+    this->updateMemoryUsage();
+}
+
+/*
+ * For internal use only!!!  Picks the peak kernels for the channel count and sample type of the wrapped file.
+ */
+void AudioUtil::selectKernels()
+{
+    this->kernels = PeakKernels::select(this->sfinfo->channels, this->sfinfo->format);
+}
+
+/*
+ * For internal use only!!!  Reopens the wrapped file after PEAKS_ONLY mode has closed its decoder.
+ */
+bool AudioUtil::reopenDecoder()
+{
+    if ((this->sndFile = openReader(this->srcFilePath, this->sfinfo, &this->sndFileDescriptor)) == NULL)
+    {
+        fprintf(stderr, "failed to reopen input file \"%s\".\n", this->srcFilePath.toStdString().c_str());
+        this->sndFileNotEmpty = false;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * For internal use only!!!  Frees the PEAKS_ONLY block data.
+ */
+void AudioUtil::clearBlockPeaks()
+{
+    vector<int8_t>().swap(this->blockPeaks8);
+    vector<int16_t>().swap(this->blockPeaks16);
+    this->sharedPeaks.release();
+    this->blockData = NULL;
+    this->blockDataValues = 0;
+}
+
+/*
+ * For internal use only!!!  Points the block accessors at whichever of blockPeaks8 and blockPeaks16 holds blocks of
+ * the given resolution, and records the settings they were built with.
+ */
+void AudioUtil::useStoredBlocks(int bits, int framesPerBlock)
+{
+    this->blockResolution = bits;
+    this->blockFrames = framesPerBlock;
+    if (bits == 8)
+    {
+        this->blockData = this->blockPeaks8.data();
+        this->blockDataValues = this->blockPeaks8.size();
+    }
+    else
+    {
+        this->blockData = this->blockPeaks16.data();
+        this->blockDataValues = this->blockPeaks16.size();
+    }
+}
+
+/*
+ * For internal use only!!!  Dequantizes one stored block value.
+ */
+double AudioUtil::blockValue(size_t index)
+{
+    if (this->blockResolution == 8)
+    {
+        return ((const int8_t *) this->blockData)[index] / 127.0;
+    }
+    return ((const int16_t *) this->blockData)[index] / 32767.0;
+}
+
+/**
+ * \brief Sets the number of bits each block minimum and maximum is stored in by PEAKS_ONLY mode: 8 or 16 (the default).
+ *
+ * Takes effect the next time the blocks are computed, when a file is set or PEAKS_ONLY mode is entered; blocks
+ * already held keep the resolution they were computed with.  Ignored while imported peak data is held, whose
+ * resolution is fixed by the peak file.
+ */
+void AudioUtil::setPeakResolution(int bits)
+{
+    if (this->peaksImported)
+    {
+        return;
+    }
+    this->peakResolution = bits == 8 ? 8 : 16;
+}
+
+/**
+ * \brief The number of bits each block minimum and maximum is stored in by PEAKS_ONLY mode.
+ */
+int AudioUtil::getPeakResolution()
+{
+    return this->peakResolution;
+}
+
+/**
+ * \brief Sets the number of frames summarized by each block in PEAKS_ONLY mode (PEAK_BLOCK_FRAMES by default).
+ *
+ * Takes effect the next time the blocks are computed, when a file is set or PEAKS_ONLY mode is entered; blocks
+ * already held keep the size they were computed with.  Ignored while imported peak data is held.
+ */
+void AudioUtil::setSamplesPerBlock(int frames)
+{
+    if (this->peaksImported)
+    {
+        return;
+    }
+    this->samplesPerBlock = std::max(1, frames);
+}
+
+/**
+ * \brief The number of frames summarized by each block in PEAKS_ONLY mode.
+ */
+int AudioUtil::getSamplesPerBlock()
+{
+    return this->samplesPerBlock;
+}
+
+/**
+ * \brief The number of blocks held in PEAKS_ONLY mode, or 0 in any other mode.
+ */
+int AudioUtil::getNumBlocks()
+{
+    if (this->getNumChannels() <= 0)
+    {
+        return 0;
+    }
+    return (int) (this->blockDataValues / (2 * this->getNumChannels()));
+}
+
+/**
+ * \brief The minimum of a channel over a block in PEAKS_ONLY mode, as a normalized value.
+ * @param block index of the block, below getNumBlocks()
+ * @param channel index of the channel, below getNumChannels()
+ */
+double AudioUtil::blockMin(int block, int channel)
+{
+    return this->blockValue(((size_t) block * this->getNumChannels() + channel) * 2);
+}
+
+/**
+ * \brief The maximum of a channel over a block in PEAKS_ONLY mode, as a normalized value.
+ * @param block index of the block, below getNumBlocks()
+ * @param channel index of the channel, below getNumChannels()
+ */
+double AudioUtil::blockMax(int block, int channel)
+{
+    return this->blockValue(((size_t) block * this->getNumChannels() + channel) * 2 + 1);
+}
+
+/*
+ * For internal use only!!!  PEAKS_ONLY implementation of peakForRegion(): for each channel, the block extreme of
+ * greatest magnitude among the blocks overlapping the region.
+ */
+vector<double> AudioUtil::peakFromBlocks(int region_start_frame, int region_end_frame)
+{
+    vector<double> regionPeaks;
+    int channels = this->getNumChannels();
+    int numBlocks = this->getNumBlocks();
+    int firstBlock = std::max(0, region_start_frame / this->blockFrames);
+    int lastBlock = std::min(numBlocks - 1, (region_end_frame - 1) / this->blockFrames);
+    if (numBlocks == 0 || firstBlock > lastBlock)
+    {
+        return regionPeaks;
+    }
+
+    for (int c = 0; c < channels; c++)
+    {
+        double peak = 0.0;
+        for (int b = firstBlock; b <= lastBlock; b++)
+        {
+            double lo = this->blockMin(b, c);
+            double hi = this->blockMax(b, c);
+            if (fabs(lo) > fabs(peak))
+            {
+                peak = lo;
+            }
+            if (fabs(hi) > fabs(peak))
+            {
+                peak = hi;
+            }
+        }
+        regionPeaks.push_back(peak);
+    }
+    return regionPeaks;
+}
+
+
+/**
+ * \brief The number of channels of the wrapped audio file.
+ *
+ *  @return the number of channels in the audio file wrapped by an instance of AudioUtil 
+ */
+int AudioUtil::getNumChannels()
+{
+        if (sfinfo != NULL)
+        {
+                return this->sfinfo->channels;
+        }
+        else
+        {
+                return NULL;
+        }
+}
+
+/**
+ * \brief The sample rate of the wrapped audio file.
+ * 
+ *  @return the sample rate of the audio file wrapped by an instance of AudioUtil
+ */
+int AudioUtil::getSampleRate()
+{
+        return this->sfinfo->samplerate;
+}
+
+
+/*!
+\brief The total number of frames of the wrapped audio file.
+@return the number of frames of the wrapped audio file.
+*/
+int AudioUtil::getTotalFrames()
+{
+    if (sfinfo != NULL)
+    {
+            return this->sfinfo->frames;
+    }
+    else
+    {
+            return NULL;
+    }
+}
+
+
+/** 
+ * \brief Get a given frame of the wrapped audio file.
+ *
+ * Function to get the frame at a given index in the audio file wrapped by an instance of AudioUtil. 
+ * Will return a double-precision floating point vector of dimension equal to the number_of_channels in the wrapped file 
+ * (either 1 or 2) containing the data of the requested frame.  In the case that a frame is requested which is out of 
+ * bounds, an error message will be printed and an empty vector returned.
+ *
+ * @param frameIndex The desired frame. 
+ *
+ * @return A vector of double-precision floating point values representing the contents of the requested frame.  In 
+ * the case that an out-of-bounds frame is requested, an empty vector will be returned. 
+ */
+vector<double> AudioUtil::grabFrame(int frameIndex)
+{
+    vector<double> frameData;
+
+    if(this->fileHandlingMode == PEAKS_ONLY)
+    {
+        perror("err in AudioUtil::grabFrame -- no sample data is kept in PEAKS_ONLY mode\n");
+        return frameData;
+    }
+
+    if(this->fileHandlingMode == FULL_CACHE)
+    {
+        int channels = this->getNumChannels();
+        if(frameIndex < 0 || frameIndex >= this->cacheFrames())
+        {
+            perror("err in AudioUtil::grabFrame -- caller attempting to access out-of-range frame\n");
+            return frameData;
+        }
+
+        frameData.resize(channels);
+        for (int c = 0; c < channels; c++)
+        {
+            frameData[c] = this->cachePlane(c)[frameIndex];
+        }
+        return frameData;
+    }
+
+    if(this->fileHandlingMode == DISK_MODE)
+    {
+        Reader *reader = this->acquireReader();
+        if (reader == NULL || !this->seekReader(reader, frameIndex))
+        {
+            perror("seek error in AudioUtil::grabFrame\n");
+            this->releaseReader(reader);
+            return frameData;
+        }
+        else
+        {
+                frameData.resize(this->getNumChannels());
+                if(this->readReader(reader, frameData.data(), 1) <= 0)
+                {
+                    perror("file read error in AudioUtil::grabFrame\n");
+                    frameData.clear();
+                }
+                this->releaseReader(reader);
                 return frameData;
+        }
+    }
+    //we should never find ourselves here, but as a precaution...
+    perror("invalid mode selected for AudioUtil instance\n");
+    return frameData;
+
+
+}
+
+/** 
+ *\brief Peak for a given region of the wrapped audio file.
+ *
+ * Function to get the peak for each channel of a given region of the audio file wrapped by an instance of AudioUtil.
+ * Returns a vector of double-precision floating point values representing this data.  In the case that
+ * an invalid region is specified by the function's parameters, prints an error message and returns an 
+ * empty vector.  This function performs drastically better when the AudioUtil instance it is being 
+ * invoked with is operating in FULL_CACHE mode rather than DISK_MODE.  
+ * 
+ * @param region_start_frame The frame marking the beginning of the region to be analyzed
+ * @param region_end_frame The frame marking the end of the region to be analyzed
+ * @return A vector of double-precision floating point values representing the peak for each channel of the specified region 
+ * of the audio file wrapped by an instance of AudioUtil.  In the case that an invalid region has been specified, return 
+ * value is an empty vector.
+ */
+vector<double> AudioUtil::peakForRegion(int region_start_frame, int region_end_frame)
+{
+ 
+    int numChannels = this->getNumChannels();
+
+    if(this->fileHandlingMode == PEAKS_ONLY)
+    {
+        return this->peakFromBlocks(region_start_frame, region_end_frame);
+    }
+
+    if(this->fileHandlingMode == FULL_CACHE && numChannels > 0)
+    {
+        /* the part of the region outside the cache contributes nothing */
+        vector<double> regionPeak(numChannels, 0.0);
+        int cachedFrames = (int) this->cacheFrames();
+        region_start_frame = std::max(0, region_start_frame);
+        region_end_frame = std::min(region_end_frame, cachedFrames);
+        for (int c = 0; c < numChannels && region_end_frame > region_start_frame; c++)
+        {
+            PlanarKernels::foldPeak(this->cachePlane(c) + region_start_frame, region_end_frame - region_start_frame, &regionPeak[c]);
+        }
+        return regionPeak;
+    }
+    if(this->fileHandlingMode == DISK_MODE)
+    {
+        vector<double> regionPeak;
+        region_end_frame = std::min(region_end_frame, this->getTotalFrames());
+        Reader *reader = this->acquireReader();
+        if(reader == NULL)
+        {
+            perror("open error in AudioUtil::peakForRegion function\n");
+        }
+        else if(!this->intervalPeaksReady)
+        {
+            regionPeak = this->peakFromDisk(reader, region_start_frame, region_end_frame);
+        }
+        else
+        {
+            regionPeak = this->peakFromIntervalPeaks(reader, region_start_frame, region_end_frame);
+        }
+        this->releaseReader(reader);
+        return regionPeak;
+   }
+   perror("err in AudioUtil::peakForRegion function.  No file is set\n");
+   return vector<double>();
+}
+
+
+/**
+ * \brief Per-channel statistics (minimum, maximum, DC offset, RMS and clipped samples) of a range of frames.
+ *
+ * The statistics of every STATISTICS_BLOCK_FRAMES frames are gathered by the analysis pass, so only the partial blocks
+ * at either end of the range are read from the cache or the file; in DISK_MODE the pass is made first if it has not
+ * been.  In PEAKS_ONLY mode nothing is read and the range is widened to whole blocks, as reported by the startFrame
+ * and endFrame of the result.
+ *
+ * @param startFrame the first frame of the range
+ * @param endFrame the frame after the last frame of the range
+ * @return the statistics of the range, with empty vectors if the range is empty or there are no samples to measure
+ * (imported peaks).  PEAKS_ONLY blocks taken from the shared peak store come with their statistics blocks.
+ */
+AudioUtil::RangeStatistics AudioUtil::statisticsForRange(int startFrame, int endFrame)
+{
+    RangeStatistics result;
+    int channels = this->getNumChannels();
+    sf_count_t first = std::max(0, startFrame);
+    sf_count_t end = std::min((sf_count_t) endFrame, (sf_count_t) this->getTotalFrames());
+    if (!this->sndFileNotEmpty || this->peaksImported || channels < 1 || end <= first)
+    {
+        return result;
+    }
+
+    if (this->fileHandlingMode == DISK_MODE && !this->statisticsReady)
+    {
+        this->calculateNormalizedPeaks();
+    }
+    bool blocksReady = this->statisticsReady;
+    sf_count_t numBlocks = blocksReady ? (sf_count_t) (this->statisticsBlocks.size() / channels) : 0;
+    if (this->fileHandlingMode == PEAKS_ONLY)
+    {
+        if (!blocksReady)
+        {
+            return result;
+        }
+        first -= first % STATISTICS_BLOCK_FRAMES;
+        end = std::min(end + (STATISTICS_BLOCK_FRAMES - end % STATISTICS_BLOCK_FRAMES) % STATISTICS_BLOCK_FRAMES,
+                       (sf_count_t) this->getTotalFrames());
+    }
+
+    /* the last block may be short, so a range running to the end of the file takes it whole */
+    sf_count_t firstBlock = (first + STATISTICS_BLOCK_FRAMES - 1) / STATISTICS_BLOCK_FRAMES;
+    sf_count_t endBlock = end >= this->getTotalFrames() ? numBlocks : std::min(end / STATISTICS_BLOCK_FRAMES, numBlocks);
+    vector<BlockStatistics> statistics(channels);
+    bool complete;
+    if (firstBlock >= endBlock)
+    {
+        complete = this->statisticsFromSamples(first, end, statistics.data());
+    }
+    else
+    {
+        complete = first >= firstBlock * STATISTICS_BLOCK_FRAMES
+                || this->statisticsFromSamples(first, firstBlock * STATISTICS_BLOCK_FRAMES, statistics.data());
+        for (sf_count_t block = firstBlock; block < endBlock; block++)
+        {
+            for (int c = 0; c < channels; c++)
+            {
+                statistics[c].merge(this->statisticsBlocks[block * channels + c]);
             }
+        }
+        complete = complete && (endBlock * STATISTICS_BLOCK_FRAMES >= end
+                || this->statisticsFromSamples(endBlock * STATISTICS_BLOCK_FRAMES, end, statistics.data()));
+    }
+    if (!complete)
+    {
+        return result;
+    }
+
+    /* a file that decoded to fewer frames than it claims has fewer in its last block */
+    result.startFrame = first;
+    result.endFrame = first + statistics[0].frames;
+    for (int c = 0; c < channels; c++)
+    {
+        double frames = (double) std::max((sf_count_t) 1, statistics[c].frames);
+        result.minimum.push_back(statistics[c].minimum);
+        result.maximum.push_back(statistics[c].maximum);
+        result.mean.push_back(statistics[c].sum / frames);
+        result.rms.push_back(sqrt(statistics[c].sumSquares / frames));
+        result.clipped.push_back(statistics[c].clipped);
+    }
+    return result;
+}
+
+/*
+ * For internal use only!!!  Folds the samples of a range into per-channel statistics, from the cache or, in
+ * DISK_MODE, through a pooled handle.  Returns false if the samples could not be read.
+ */
+bool AudioUtil::statisticsFromSamples(sf_count_t startFrame, sf_count_t endFrame, BlockStatistics *statistics)
+{
+    int channels = this->getNumChannels();
+    if (this->fileHandlingMode == FULL_CACHE)
+    {
+        if (endFrame > this->cacheFrames())
+        {
+            return false;
+        }
+        for (int c = 0; c < channels; c++)
+        {
+            PlanarKernels::accumulateStatistics(this->cachePlane(c) + startFrame, endFrame - startFrame, &statistics[c]);
+        }
+        return true;
+    }
+    if (this->fileHandlingMode != DISK_MODE)
+    {
+        return false;
+    }
+
+    Reader *reader = this->acquireReader();
+    if (reader == NULL || !this->seekReader(reader, startFrame))
+    {
+        perror("read error in AudioUtil::statisticsForRange function\n");
+        this->releaseReader(reader);
+        return false;
+    }
+    static thread_local vector<double> chunk;
+    chunk.resize((size_t) this->ioPolicy.readBlockFrames * channels);
+    sf_count_t remaining = endFrame - startFrame;
+    while (remaining > 0)
+    {
+        sf_count_t got = this->readReader(reader, chunk.data(), std::min((sf_count_t) this->ioPolicy.readBlockFrames, remaining));
+        if (got <= 0)
+        {
+            break;
+        }
+        this->kernels->accumulateStatistics(chunk.data(), got, channels, statistics);
+        remaining -= got;
+    }
+    this->releaseReader(reader);
+    return remaining == 0;
+}
+
+/**
+ * \brief The content of the wrapped audio file.
+ *
+ * Function to get all frames of the audio file wrapped by an instance of AudioUtil as a vector of double-precision 
+ * floating-point values.
+ *
+ * @return a vector of double-precision floating-point values representing all frames of the audio file wrapped by this
+ * instance of AudioUtil.
+ */
+vector<double> AudioUtil::getAllFrames()
+{
+
+   if(this->fileHandlingMode == FULL_CACHE)
+   {
+      /* the cache is planar; callers get interleaved frames, as from libsndfile */
+      int channels = this->getNumChannels();
+      sf_count_t frames = this->cacheFrames();
+      vector<double> dataVector((size_t) frames * channels);
+      for (int c = 0; c < channels; c++)
+      {
+          const double *plane = this->cachePlane(c);
+          for (sf_count_t i = 0; i < frames; i++)
+          {
+              dataVector[i * channels + c] = plane[i];
+          }
+      }
+      return dataVector;
+   }
+   else if(this->fileHandlingMode == PEAKS_ONLY)
+   {
+      perror("err in AudioUtil::getAllFrames -- no sample data is kept in PEAKS_ONLY mode\n");
+      return vector<double>();
+   }
+   else
+   {
+       vector<double> dataVector;
+       int channels = this->getNumChannels();
+       sf_count_t totalFrames = this->sfinfo->frames;
+       Reader *reader = this->acquireReader();
+       if (reader == NULL)
+       {
+           return dataVector;
+       }
+
+       dataVector.resize(totalFrames * channels);
+       this->adviseScan(reader->descriptor, 0, totalFrames);
+       sf_count_t framesRead = this->readFramesInto(reader->file, 0, totalFrames, dataVector.data(), channels);
+       this->adviseDone(reader->descriptor);
+       reader->position = framesRead < totalFrames ? -1 : framesRead;
+       this->releaseReader(reader);
+       if (framesRead < totalFrames)
+       {
+           dataVector.resize(framesRead * channels);
+       }
+
+       return dataVector;
+   }
+}
 
-            else
-            {
-                frameData.push_back(this->fileCache.at(frameIndex));
-            }
-        }
 
-        if(this->getNumChannels() == 2)
+/**
+ * \brief Spectral balance of the wrapped audio file, one entry per display column.
+ *
+ * Divides the file into the given number of equal columns and, for each column, runs a short-time FFT
+ * (SPECTRUM_FFT_SIZE points, Hann window) over up to SPECTRUM_MAX_WINDOWS_PER_COLUMN windows spread across it.  The
+ * energy of the channel mix is then split into three bands: low (below SPECTRUM_LOW_MID_HZ), mid and high (above
+ * SPECTRUM_MID_HIGH_HZ).  Columns are processed in parallel chunks, each DISK_MODE chunk through its own libsndfile
+ * handle, on as many threads as the helper thread budget allows (see setHelperThreadBudget()).  The result
+ * is kept until the file or the column count changes.
+ *
+ * @param columns the number of columns to divide the file into
+ * @return a vector of 3*columns values holding, for each column, the share of its energy in the low, mid and high
+ * bands (each between 0 and 1, summing to 1, or all 0 for a silent column).  Empty if no file is set.
+ */
+vector<double> AudioUtil::bandEnergiesForColumns(int columns)
+{
+    if (!this->sndFileNotEmpty || columns <= 0 || this->fileHandlingMode == PEAKS_ONLY)
+    {
+        return vector<double>();
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->spectralMutex);
+        if (columns == this->spectralColumns)
         {
-            if(2*frameIndex+1 >= (int) this->fileCache.size())
-            {
-                perror("err in AudioUtil::grabFrame -- caller attempting to access out-of-range frame\n");
-                return frameData;
-            }
-            else
-            {
-                frameData.push_back(this->fileCache.at(2*frameIndex));
-                frameData.push_back(this->fileCache.at(2*frameIndex+1));
-            }
-
+            return this->spectralBands;
         }
-
     }
 
-    if(this->fileHandlingMode == DISK_MODE)
+    vector<double> bands(columns * 3, 0.0);
+
+    int numThreads = (int) std::thread::hardware_concurrency();
+    numThreads = std::max(1, std::min(std::min(numThreads, MAX_DECODE_THREADS), columns));
+    std::function<void(int)> releaseHelpers;
+    int helpers = reserveHelpers(numThreads - 1, releaseHelpers);
+    numThreads = helpers + 1;
+    int columnsPerThread = (columns + numThreads - 1) / numThreads;
+    vector<std::thread> workers;
+    QString filePath = this->srcFilePath;
+    bool fromDisk = this->fileHandlingMode == DISK_MODE;
+
+    std::function<void(int, int)> computeChunk = [=, &bands](int firstColumn, int lastColumn)
     {
-        if (sf_seek(sndFile, frameIndex, SEEK_SET) == -1)
+        SNDFILE *reader = NULL;
+        SF_INFO info;
+        if (fromDisk && (reader = this->openReader(filePath, &info)) == NULL)
         {
-            perror("seek error in AudioUtil::grabFrame\n");
-            return frameData;
+            return;
         }
-        else
+        this->computeBandEnergies(reader, firstColumn, lastColumn, columns, bands.data());
+        if (reader != NULL)
         {
-                if(sf_readf_double(sndFile, data, 1) == 0)
-                {
-                    perror("file read error in AudioUtil::grabFrame\n");
-                    return frameData;
+            sf_close(reader);
+        }
+    };
 
-                }
-                else
-                {
-                    if(this->getNumChannels() == 2)
-                    {
-                        frameData.push_back(data[0]);
-                        frameData.push_back(data[1]);
-                        return frameData;
-                    }
-                    if(this->getNumChannels() == 1)
-                    {
-                        frameData.push_back(data[0]);
-                        return frameData;
-                    }
-                }
+    /* chunk 0 is computed on this thread */
+    for (int i = 1; i < numThreads; i++)
+    {
+        int firstColumn = i * columnsPerThread;
+        int lastColumn = std::min(columns, firstColumn + columnsPerThread);
+        if (firstColumn >= lastColumn)
+        {
+            break;
         }
+        workers.push_back(std::thread(computeChunk, firstColumn, lastColumn));
     }
-    //we should never find ourselves here, but as a precaution...
-    perror("invalid mode selected for AudioUtil instance\n");
-    return frameData;
+    computeChunk(0, std::min(columns, columnsPerThread));
 
+    for (unsigned int i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    releaseHelpers(helpers);
 
+    {
+        std::lock_guard<std::mutex> lock(this->spectralMutex);
+        this->spectralBands = bands;
+        this->spectralColumns = columns;
+    }
+    this->updateMemoryUsage();
+    return bands;
 }
 
-/** 
- *\brief Peak for a given region of the wrapped audio file.
- *
- * Function to get the peak for each channel of a given region of the audio file wrapped by an instance of AudioUtil.
- * Returns a vector of double-precision floating point values representing this data.  In the case that
- * an invalid region is specified by the function's parameters, prints an error message and returns an 
- * empty vector.  This function performs drastically better when the AudioUtil instance it is being 
- * invoked with is operating in FULL_CACHE mode rather than DISK_MODE.  
- * 
- * @param region_start_frame The frame marking the beginning of the region to be analyzed
- * @param region_end_frame The frame marking the end of the region to be analyzed
- * @return A vector of double-precision floating point values representing the peak for each channel of the specified region 
- * of the audio file wrapped by an instance of AudioUtil.  In the case that an invalid region has been specified, return 
- * value is an empty vector.
+/**
+ * For internal use only!!!  Computes the band energies of columns [firstColumn, lastColumn) into bands.  Frames are
+ * read from the cache, or, if reader is not NULL, through that handle.
  */
-vector<double> AudioUtil::peakForRegion(int region_start_frame, int region_end_frame)
+void AudioUtil::computeBandEnergies(SNDFILE *reader, int firstColumn, int lastColumn, int columns, double *bands)
 {
- 
-    int numChannels = this->getNumChannels();
+    int channels = this->getNumChannels();
+    sf_count_t totalFrames = reader != NULL ? this->sfinfo->frames : this->cacheFrames();
+    double framesPerColumn = (double) totalFrames / columns;
+    double binHz = (double) this->getSampleRate() / SPECTRUM_FFT_SIZE;
 
-    if(this->fileHandlingMode == FULL_CACHE)
+    vector<double> window(SPECTRUM_FFT_SIZE);
+    for (int i = 0; i < SPECTRUM_FFT_SIZE; i++)
     {
-        if(numChannels == 2)
-        {
-            this->regionPeak.clear();
+        window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / (SPECTRUM_FFT_SIZE - 1));
+    }
+    vector<double> re(SPECTRUM_FFT_SIZE);
+    vector<double> im(SPECTRUM_FFT_SIZE);
+    vector<double> chunk(SPECTRUM_FFT_SIZE * channels);
 
-            double max0 = 0.0;
-            double max1 = 0.0;
+    for (int col = firstColumn; col < lastColumn; col++)
+    {
+        sf_count_t start = (sf_count_t) (col * framesPerColumn);
+        sf_count_t length = (sf_count_t) ((col + 1) * framesPerColumn) - start;
+        int windows = (int) std::max((sf_count_t) 1, std::min((sf_count_t) SPECTRUM_MAX_WINDOWS_PER_COLUMN, length / SPECTRUM_FFT_SIZE));
+        double energy[3] = {0.0, 0.0, 0.0};
 
-             for (int i = 2*region_start_frame; i <  2*region_end_frame; i+=2)
-             {
-                  if(fabs(fileCache[i]) > fabs(max0))
+        for (int w = 0; w < windows; w++)
+        {
+            sf_count_t windowStart = start + (sf_count_t) ((length - SPECTRUM_FFT_SIZE) * (w + 0.5) / windows);
+            windowStart = std::max((sf_count_t) 0, std::min(windowStart, totalFrames - SPECTRUM_FFT_SIZE));
+            sf_count_t available = std::min((sf_count_t) SPECTRUM_FFT_SIZE, totalFrames - windowStart);
+
+            /* the channels are mixed down into re */
+            std::fill(re.begin(), re.end(), 0.0);
+            std::fill(im.begin(), im.end(), 0.0);
+            if (reader != NULL)
+            {
+                if (sf_seek(reader, windowStart, SEEK_SET) == -1)
                 {
-                  max0 = fileCache[i];
+                    continue;
                 }
-                if(fabs(fileCache[i+1]) > fabs(max1))
+                available = std::max((sf_count_t) 0, sf_readf_double(reader, chunk.data(), available));
+                for (sf_count_t i = 0; i < available; i++)
                 {
-                    max1 = fileCache[i+1];
+                    for (int c = 0; c < channels; c++)
+                    {
+                        re[i] += chunk[i * channels + c];
+                    }
                 }
-
             }
-
-            this->regionPeak.push_back(max0);
-            this->regionPeak.push_back(max1);
-
-           return regionPeak;
-       }
-
-        if(numChannels == 1)
-        {
-            this->regionPeak.clear();
-
-            double max0 = 0.0;
-
-             for (int i = region_start_frame; i <  region_end_frame; i++)
-             {
-                if(fabs(fileCache[i]) > fabs(max0))
+            else
+            {
+                for (int c = 0; c < channels; c++)
                 {
-                  max0 = fileCache[i];
+                    const double *plane = this->cachePlane(c) + windowStart;
+                    for (sf_count_t i = 0; i < available; i++)
+                    {
+                        re[i] += plane[i];
+                    }
                 }
             }
 
-           this->regionPeak.push_back(max0);
-
-           return this->regionPeak;
-       }
-
-    }
-    if(this->fileHandlingMode == DISK_MODE)
-    {
-        if(numChannels == 2)
-        {
-            this->regionPeak.clear();
-            double *chunk = new double[ 2*(region_end_frame - region_start_frame)];
-             //seek to region start
-            if (sf_seek(sndFile, region_start_frame, SEEK_SET) == -1)
+            for (int i = 0; i < SPECTRUM_FFT_SIZE; i++)
             {
-                 perror("seek error in AudioUtil::peakForRegion function\n");
-                 return this->regionPeak;
+                re[i] *= window[i];
             }
-            /*read the region into an array*/
-            if(sf_readf_double(sndFile, chunk, (region_end_frame - region_start_frame) ) == 0)
+
+            MathUtil::fft(re.data(), im.data(), SPECTRUM_FFT_SIZE);
+
+            for (int k = 1; k <= SPECTRUM_FFT_SIZE / 2; k++)
             {
-                perror("read error in AudioUtil::peakForRegion function\n");
-                return this->regionPeak;
+                double power = re[k] * re[k] + im[k] * im[k];
+                double hz = k * binHz;
+                energy[hz < SPECTRUM_LOW_MID_HZ ? 0 : (hz < SPECTRUM_MID_HIGH_HZ ? 1 : 2)] += power;
             }
+        }
 
-            double max0 = 0.0;
-            double max1 = 0.0;
+        double total = energy[0] + energy[1] + energy[2];
+        for (int b = 0; b < 3; b++)
+        {
+            bands[col * 3 + b] = total > 0.0 ? energy[b] / total : 0.0;
+        }
+    }
+}
 
-             for (int i = 0; i <  2*(region_end_frame - region_start_frame); i+=2)
-             {
-                  if(fabs(chunk[i]) > fabs(max0))
-                {
-                  max0 = chunk[i];
-                }
-                if(fabs(chunk[i+1]) > fabs(max1))
-                {
-                    max1 = (chunk[i+1]);
-                }
 
-            }
+/**
+ * For internal use only!!!  Function populates the fileCache vector with the contents of the audio file wrapped by this 
+ * instance of AudioUtil.
+ *
+ * The cache is allocated once at its final size.  For seekable files that are large enough to be worth it, the frame
+ * range is split into disjoint segments, each of which is decoded on its own thread through its own libsndfile handle
+ * directly into its place in the cache; the threads besides the calling one come out of the helper thread budget
+ * (see setHelperThreadBudget()), and when it has none to spare the file is decoded serially.  Everything else is decoded serially through the instance's own
+ * handle.
+ */
+void AudioUtil::populateCache()
+{
+    this->fileCache.clear();
+    if (!this->sndFileNotEmpty)
+    {
+        return;
+    }
 
-            this->regionPeak.push_back(max0);
-            this->regionPeak.push_back(max1);
+    int channels = this->getNumChannels();
+    sf_count_t totalFrames = this->sfinfo->frames;
+    this->fileCache.resize(totalFrames * channels);
+    double *cache = this->fileCache.data();
+    this->resetProgress();
 
-           delete[] chunk;
+    int numThreads = (int) std::thread::hardware_concurrency();
+    if (numThreads > MAX_DECODE_THREADS)
+    {
+        numThreads = MAX_DECODE_THREADS;
+    }
+    if (numThreads > totalFrames / MIN_FRAMES_PER_DECODE_THREAD)
+    {
+        numThreads = (int) (totalFrames / MIN_FRAMES_PER_DECODE_THREAD);
+    }
+    /* the threads besides this one come out of the budget, so that concurrent loads stay within the application's limit */
+    std::function<void(int)> releaseHelpers;
+    int helpers = 0;
+    if (this->sfinfo->seekable && numThreads >= 2)
+    {
+        helpers = reserveHelpers(numThreads - 1, releaseHelpers);
+    }
+    numThreads = helpers + 1;
 
-           return regionPeak;
-       }
+    if (!this->sfinfo->seekable || numThreads < 2)
+    {
+        vector<double> channelPeaks(channels, 0.0);
+        sf_count_t framesRead = 0;
+        if (sf_seek(this->sndFile, 0, SEEK_SET) == -1)
+        {
+            fprintf(stderr, "seek failed in AudioUtil::populateCache() function\n");
+        }
+        else
+        {
+            SNDFILE *file = this->sndFile;
+            this->adviseScan(this->sndFileDescriptor, 0, totalFrames);
+            this->pipelinedScan(this->ioPolicy.readBlockFrames, [file](double *dest, sf_count_t frames)
+            {
+                return sf_readf_double(file, dest, frames);
+            },
+            [&](const double *frames, sf_count_t frameCount)
+            {
+                frameCount = std::min(frameCount, totalFrames - framesRead);
+                PlanarKernels::deinterleave(frames, frameCount, channels, cache + framesRead, totalFrames);
+                this->kernels->accumulatePeaks(frames, frameCount, channels, channelPeaks.data());
+                framesRead += frameCount;
+                this->reportProgress(frameCount);
+                return framesRead < totalFrames && !this->cancelRequested;
+            });
+        }
+        this->adviseDone(this->sndFileDescriptor);
+        this->truncateCache(framesRead);
+        this->peaks = channelPeaks;
+        this->buildIntervalPeaksFromCache();
+        this->peaksValid = !this->cancelRequested;
+        return;
+    }
 
+    sf_count_t framesPerSegment = (totalFrames + numThreads - 1) / numThreads;
+    vector<sf_count_t> segmentFramesRead(numThreads, 0);
+    /* each segment keeps its own per-channel peaks; they are merged once every segment is done */
+    vector<double> segmentPeaks(numThreads * channels, 0.0);
+    vector<std::thread> workers;
+    QString filePath = this->srcFilePath;
 
-        if(numChannels == 1)
+    /* segment 0 is decoded on this thread through the instance's own handle */
+    for (int i = 1; i < numThreads; i++)
+    {
+        workers.push_back(std::thread([=, &segmentFramesRead, &segmentPeaks]()
         {
-            this->regionPeak.clear();
-            double *chunk = new double[ region_end_frame - region_start_frame];
-             //seek to region start
-            if (sf_seek(sndFile, region_start_frame, SEEK_SET) == -1)
-            {
-                perror("seek error in AudioUtil::peakForRegion function\n");
-                return this->regionPeak;
-            }
-            /*read the region into an array*/
-            if(sf_readf_double(sndFile, chunk, (region_end_frame - region_start_frame) ) == 0)
+            sf_count_t start = i * framesPerSegment;
+            sf_count_t count = std::min(framesPerSegment, totalFrames - start);
+            SF_INFO info;
+            int descriptor;
+            SNDFILE *reader = this->openReader(filePath, &info, &descriptor);
+            if (reader == NULL)
             {
-                perror("read error in AudioUtil::peakForRegion function\n");
-                return this->regionPeak;
+                return;
             }
+            this->adviseScan(descriptor, start, count);
+            segmentFramesRead[i] = this->readFramesInto(reader, start, count, cache + start, channels, &segmentPeaks[i * channels], totalFrames);
+            this->adviseDone(descriptor);
+            sf_close(reader);
+        }));
+    }
 
-            double max0 = 0.0;
+    this->adviseScan(this->sndFileDescriptor, 0, framesPerSegment);
+    segmentFramesRead[0] = readFramesInto(this->sndFile, 0, framesPerSegment, cache, channels, &segmentPeaks[0], totalFrames);
 
-             for (int i = 0; i <  region_end_frame - region_start_frame; i++)
-             {
-                if(fabs(chunk[i]) > max0)
-                {
-                  max0 = fabs(chunk[i]);
-                }
-            }
+    for (unsigned int i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    releaseHelpers(helpers);
+    this->adviseDone(this->sndFileDescriptor);
 
-           this->regionPeak.push_back(max0);
+    if (this->cancelRequested)
+    {
+        return;
+    }
 
-           delete[] chunk;
+    /* any segment whose worker could not open or read its handle is redone serially */
+    for (int i = 1; i < numThreads; i++)
+    {
+        sf_count_t start = i * framesPerSegment;
+        sf_count_t count = std::min(framesPerSegment, totalFrames - start);
+        if (segmentFramesRead[i] < count)
+        {
+            sf_count_t done = segmentFramesRead[i];
+            readFramesInto(this->sndFile, start + done, count - done, cache + start + done, channels, &segmentPeaks[i * channels], totalFrames);
+        }
+    }
 
-           return this->regionPeak;
-       }
-   }
-   perror("err in AudioUtil::peakForRegion function.  Max channels: 2\n");
-   return this->regionPeak;
+    this->peaks.assign(channels, 0.0);
+    for (int i = 0; i < numThreads; i++)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            this->peaks[c] = std::max(this->peaks[c], segmentPeaks[i * channels + c]);
+        }
+    }
+    this->buildIntervalPeaksFromCache();
+    this->peaksValid = true;
 }
 
-
 /**
- * \brief The content of the wrapped audio file.
- *
- * Function to get all frames of the audio file wrapped by an instance of AudioUtil as a vector of double-precision 
- * floating-point values.
- *
- * @return a vector of double-precision floating-point values representing all frames of the audio file wrapped by this
- * instance of AudioUtil.
+ * For internal use only!!!  Builds the interval peaks from a freshly populated cache, so that they are already there if
+ * the cache is later dropped in favour of DISK_MODE.
  */
-vector<double> AudioUtil::getAllFrames()
+void AudioUtil::buildIntervalPeaksFromCache()
 {
+    int channels = this->getNumChannels();
+    sf_count_t cachedFrames = this->cacheFrames();
+    this->intervalPeaks.assign((size_t) ((cachedFrames + PEAK_INTERVAL_FRAMES - 1) / PEAK_INTERVAL_FRAMES) * channels, 0.0);
 
-   if(this->fileHandlingMode == FULL_CACHE)
-   {
-      return this->fileCache;
-   }
-   else
-   {
-       this->dataVector.clear();
-       int readSize = 1024;
+    for (sf_count_t start = 0; start < cachedFrames; start += PEAK_INTERVAL_FRAMES)
+    {
+        sf_count_t count = std::min((sf_count_t) PEAK_INTERVAL_FRAMES, cachedFrames - start);
+        for (int c = 0; c < channels; c++)
+        {
+            PlanarKernels::foldPeak(this->cachePlane(c) + start, count, &this->intervalPeaks[(start / PEAK_INTERVAL_FRAMES) * channels + c]);
+        }
+    }
+    this->intervalPeaksReady = true;
 
-       //seek to file start
-      if (sf_seek(sndFile, 0, SEEK_SET) == -1)
-      {
-          fprintf(stderr, "seek failed in AudioUtil::getAllFrames() function\n");
-      }
-       double *chunk = new double[readSize];
-       int itemsRead = sf_read_double(this->sndFile, chunk, readSize);
+    vector<BlockStatistics> statistics((size_t) ((cachedFrames + STATISTICS_BLOCK_FRAMES - 1) / STATISTICS_BLOCK_FRAMES) * channels);
+    for (sf_count_t start = 0; start < cachedFrames; start += STATISTICS_BLOCK_FRAMES)
+    {
+        sf_count_t count = std::min((sf_count_t) STATISTICS_BLOCK_FRAMES, cachedFrames - start);
+        for (int c = 0; c < channels; c++)
+        {
+            PlanarKernels::accumulateStatistics(this->cachePlane(c) + start, count, &statistics[(start / STATISTICS_BLOCK_FRAMES) * channels + c]);
+        }
+    }
+    this->statisticsBlocks.swap(statistics);
+    this->statisticsReady = true;
+}
 
-       while(itemsRead == readSize)
-       {
+/*
+ * For internal use only!!!  Folds interleaved frames, the first of which is frame firstFrame of the file, into the
+ * statistics blocks they fall in, appending blocks as the frames reach them.
+ */
+void AudioUtil::accumulateBlockStatistics(const double *frames, sf_count_t firstFrame, sf_count_t frameCount, vector<BlockStatistics> &blocks)
+{
+    int channels = this->getNumChannels();
+    while (frameCount > 0)
+    {
+        sf_count_t block = firstFrame / STATISTICS_BLOCK_FRAMES;
+        sf_count_t count = std::min(frameCount, (block + 1) * STATISTICS_BLOCK_FRAMES - firstFrame);
+        if (blocks.size() < (size_t) (block + 1) * channels)
+        {
+            blocks.resize((size_t) (block + 1) * channels);
+        }
+        this->kernels->accumulateStatistics(frames, count, channels, &blocks[block * channels]);
+        frames += count * channels;
+        firstFrame += count;
+        frameCount -= count;
+    }
+}
 
-           for(int i = 0; i < readSize; i++)
-           {
-                this->dataVector.push_back(chunk[i]);
-           }
+/*
+ * For internal use only!!!  The number of frames in the cache, which is the length of each of its channel planes.
+ */
+sf_count_t AudioUtil::cacheFrames()
+{
+    int channels = this->getNumChannels();
+    return channels > 0 ? (sf_count_t) (this->fileCache.size() / channels) : 0;
+}
 
-           itemsRead = sf_read_double(this->sndFile, chunk, readSize);
-       }
+/*
+ * For internal use only!!!  The cached samples of one channel, cacheFrames() of them, contiguous.
+ */
+const double *AudioUtil::cachePlane(int channel)
+{
+    return this->fileCache.data() + channel * this->cacheFrames();
+}
 
-       //add the last items to the vector
-       for(int i = 0; i < itemsRead; i++)
-       {
-            this->dataVector.push_back(chunk[i]);
-       }
+/*
+ * For internal use only!!!  Shortens each plane of a cache populated with fewer frames than it was sized for,
+ * moving the planes down so that they stay contiguous.
+ */
+void AudioUtil::truncateCache(sf_count_t frames)
+{
+    int channels = this->getNumChannels();
+    sf_count_t planeFrames = this->cacheFrames();
+    if (frames >= planeFrames)
+    {
+        return;
+    }
+    double *cache = this->fileCache.data();
+    for (int c = 1; c < channels; c++)
+    {
+        memmove(cache + c * frames, cache + c * planeFrames, (size_t) frames * sizeof(double));
+    }
+    this->fileCache.resize((size_t) frames * channels);
+}
 
-       delete[] chunk;
+/**
+ * For internal use only!!!  Seeks the given handle to startFrame and decodes up to frameCount frames straight
+ * into dest, in blocks of IOPolicy::readBlockFrames frames.  If channelPeaks is given, each block is folded into it as it
+ * arrives.  Returns the number of frames actually read.
+ *
+ * If planeFrames is given, dest is the first frame's slot in the first of several channel planes planeFrames frames
+ * apart, and each block is decoded into scratch space private to the calling thread and deinterleaved from there.
+ */
+sf_count_t AudioUtil::readFramesInto(SNDFILE *file, sf_count_t startFrame, sf_count_t frameCount, double *dest, int channels, double *channelPeaks, sf_count_t planeFrames)
+{
+    if (sf_seek(file, startFrame, SEEK_SET) == -1)
+    {
+        fprintf(stderr, "seek failed in AudioUtil::readFramesInto() function\n");
+        return 0;
+    }
 
-       return this->dataVector;
-   }
+    sf_count_t framesRead = 0;
+    while (framesRead < frameCount)
+    {
+        sf_count_t request = std::min((sf_count_t) this->ioPolicy.readBlockFrames, frameCount - framesRead);
+        double *block = dest + framesRead * channels;
+        if (planeFrames > 0)
+        {
+            static thread_local vector<double> scratch;
+            scratch.resize((size_t) request * channels);
+            block = scratch.data();
+        }
+        sf_count_t got = sf_readf_double(file, block, request);
+        if (got <= 0)
+        {
+            break;
+        }
+        if (channelPeaks != NULL)
+        {
+            this->kernels->accumulatePeaks(block, got, channels, channelPeaks);
+        }
+        if (planeFrames > 0)
+        {
+            PlanarKernels::deinterleave(block, got, channels, dest + framesRead, planeFrames);
+        }
+        framesRead += got;
+        this->reportProgress(got);
+        if (this->cancelRequested)
+        {
+            break;
+        }
+    }
+    return framesRead;
 }
 
+/**
+ * \brief Sets a function to be told how far along the cache population or analysis pass is.
+ *
+ * The callback is passed a percentage between 0 and 100, and is only invoked when that percentage grows.  It may be
+ * invoked from any of the threads decoding the file, so it must be safe to call from outside the thread that owns
+ * this instance of AudioUtil.
+ *
+ * @param callback function taking the progress of the current pass as a percentage
+ */
+void AudioUtil::setProgressCallback(std::function<void(int)> callback)
+{
+    this->progressCallback = callback;
+}
 
 /**
- * For internal use only!!!  Function populates the fileCache vector with the contents of the audio file wrapped by this 
- * instance of AudioUtil.
+ * \brief Asks a cache population or analysis pass running on another thread to stop as soon as possible.
+ *
+ * Cancellation is permanent: once requested, every later pass on this instance stops at its first block, leaving
+ * the cache and peaks incomplete.  It is meant for throwing away an instance that is still loading.
  */
-void AudioUtil::populateCache()
+void AudioUtil::requestCancel()
 {
-    this->fileCache.clear();
-    int readSize = 1024;
+    this->cancelRequested = true;
+}
 
-    //seek to file start
-   if (sf_seek(sndFile, 0, SEEK_SET) == -1)
-   {
-       fprintf(stderr, "seek failed in AudioUtil::getAllFrames() function\n");
-   }
+/**
+ * \brief Whether requestCancel() has been called on this instance.
+ * @return true if loading has been cancelled, false otherwise
+ */
+bool AudioUtil::isCancelRequested()
+{
+    return this->cancelRequested;
+}
 
-    double *chunk = new double[readSize];
-    int itemsRead = sf_read_double(this->sndFile, chunk, readSize);
+/**
+ * For internal use only!!!  Restarts progress reporting at the beginning of a pass.
+ */
+void AudioUtil::resetProgress()
+{
+    this->framesProcessed = 0;
+    this->lastReportedProgress = -1;
+}
 
-    while(itemsRead == readSize)
+/**
+ * For internal use only!!!  Records that frameCount more frames have been decoded, and tells the progress callback
+ * if that moved the overall percentage.  Safe to call from several decoding threads at once.
+ */
+void AudioUtil::reportProgress(sf_count_t frameCount)
+{
+    if (!this->progressCallback || this->sfinfo->frames <= 0)
     {
-
-        for(int i = 0; i < readSize; i++)
-        {
-             this->fileCache.push_back(chunk[i]);
-        }
-
-        itemsRead = sf_read_double(this->sndFile, chunk, readSize);
+        return;
     }
 
-    //add the last items to the vector
-    for(int i = 0; i < itemsRead; i++)
+    sf_count_t done = (this->framesProcessed += frameCount);
+    int percent = (int) std::min((sf_count_t) 100, done * 100 / this->sfinfo->frames);
+    int last = this->lastReportedProgress;
+    while (percent > last)
     {
-         this->fileCache.push_back(chunk[i]);
+        if (this->lastReportedProgress.compare_exchange_weak(last, percent))
+        {
+            this->progressCallback(percent);
+            break;
+        }
     }
-
-    delete[] chunk;
-
 }
 
 
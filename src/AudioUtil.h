@@ -7,14 +7,39 @@
 #include <stdlib.h>
 #include <math.h>
 #include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
 #include <QString>
+#include <QByteArray>
+
+#include "RingBuffer.h"
+#include "PeakKernels.h"
+#include "SharedPeakStore.h"
 
 /*!
     \file AudioUtil.h
     \brief AudioUtil header file
  */
 
-#define MAX_CHANNELS 2
+#define READ_BLOCK_FRAMES 65536
+#define MAX_DECODE_THREADS 8
+#define MIN_FRAMES_PER_DECODE_THREAD 262144
+#define SPECTRUM_FFT_SIZE 1024
+#define SPECTRUM_MAX_WINDOWS_PER_COLUMN 4
+#define SPECTRUM_LOW_MID_HZ 250.0
+#define SPECTRUM_MID_HIGH_HZ 4000.0
+#define PEAK_BLOCK_FRAMES 256
+#define PEAK_INTERVAL_FRAMES 16384
+#define SEEK_FORWARD_READ_LIMIT 65536
+#define STATISTICS_BLOCK_FRAMES 16384
+#define MAX_POOLED_READERS 4
+#define PIPELINE_BUFFERS 4
+#define DEFAULT_MEMORY_BUDGET ((size_t) 1024 * 1024 * 1024)
 
 using namespace std;
 
@@ -22,6 +47,8 @@ using namespace std;
 \brief Provides a number of utilities for pulling useful data from audio files.
 
 This class began as a nice, object-oriented wrapper for certain functions that I found myself frequently using in Erik de Castro Lopo's <a href="http://www.mega-nerd.com/libsndfile/">libsndfile</a>.  It now supports an optional caching scheme (enabled by calling setFileHandlingMode(AudioUtil::FULL_CACHE) on an instance of AudioUtil)  to dramatically speed up the performance of certain functions, like that for accessing arbitrary frames (grabFrame()) of an audio file and that for determining the peak value for a given region of an audio file (peakForRegion()).
+
+The query functions (grabFrame(), peakForRegion(), getAllFrames(), calculateNormalizedPeaks(), bandEnergiesForColumns() and statisticsForRange(), along with the accessors) may be called from any number of threads at once.  In FULL_CACHE and PEAKS_ONLY mode they only read immutable data and take no locks; in DISK_MODE each call borrows one of a small pool of libsndfile handles (at most MAX_POOLED_READERS per instance) for its duration.  setFile() and setFileHandlingMode() must not run concurrently with any other call on the same instance.
 */
 class AudioUtil
 {
@@ -38,24 +65,205 @@ public:
         vector<double> grabFrame(int frameIndex);
         vector<double> peakForRegion(int region_start_frame, int region_end_frame);
         vector<double> getAllFrames();
-        enum FileHandlingMode {FULL_CACHE, DISK_MODE};
+        vector<double> bandEnergiesForColumns(int columns);
+        /*!
+        \brief Per-channel statistics of a range of frames.  See statisticsForRange().
+        */
+        struct RangeStatistics
+        {
+            /*!\brief The frames the statistics cover, which may be wider than the range asked for (PEAKS_ONLY) or narrower (past the end of the file).*/
+            sf_count_t startFrame;
+            sf_count_t endFrame;
+            /*!\brief The lowest and highest sample of each channel.*/
+            vector<double> minimum;
+            vector<double> maximum;
+            /*!\brief The mean of each channel, i.e. its DC offset.*/
+            vector<double> mean;
+            /*!\brief The root mean square of each channel.*/
+            vector<double> rms;
+            /*!\brief The number of samples of each channel at or above CLIP_LEVEL in magnitude.*/
+            vector<sf_count_t> clipped;
+            RangeStatistics() : startFrame(0), endFrame(0) {}
+        };
+        RangeStatistics statisticsForRange(int startFrame, int endFrame);
+        enum FileHandlingMode {FULL_CACHE, DISK_MODE, AUTO, PEAKS_ONLY};
+        /*!
+        \brief How an instance of AudioUtil reads its file.  See setIOPolicy().
+        */
+        struct IOPolicy
+        {
+            /*!\brief Frames requested from libsndfile per read in whole-file passes and region scans.*/
+            int readBlockFrames;
+            /*!\brief Tell the kernel (posix_fadvise SEQUENTIAL and WILLNEED) when a handle is about to be read end to end.*/
+            bool adviseSequential;
+            /*!\brief Drop the file from the page cache (posix_fadvise DONTNEED) once an analysis pass has finished with it.*/
+            bool dropCacheAfterScan;
+            /*!\brief Try to open the file with O_DIRECT, bypassing the page cache; see setIOPolicy().*/
+            bool directIO;
+            IOPolicy() : readBlockFrames(READ_BLOCK_FRAMES), adviseSequential(true), dropCacheAfterScan(false), directIO(false) {}
+        };
+        void setIOPolicy(const IOPolicy &policy);
+        IOPolicy getIOPolicy();
+        /*!
+        \brief Where a file's data lies on disk, for reading many files in an order that keeps seeks short.  See locateFile().
+        */
+        struct FileLocation
+        {
+            /*!\brief Whether the file could be found at all.*/
+            bool valid;
+            /*!\brief The device and inode (st_dev and st_ino) of the file.*/
+            uint64_t device;
+            uint64_t inode;
+            /*!\brief The physical byte offset of the file's first extent on the device, or 0 if it is not known.*/
+            uint64_t physicalOffset;
+            FileLocation() : valid(false), device(0), inode(0), physicalOffset(0) {}
+            bool operator<(const FileLocation &other) const
+            {
+                if (device != other.device)
+                    return device < other.device;
+                if (physicalOffset != other.physicalOffset)
+                    return physicalOffset < other.physicalOffset;
+                return inode < other.inode;
+            }
+        };
+        static FileLocation locateFile(QString filePath);
         FileHandlingMode getFileHandlingMode();
         void setFileHandlingMode(FileHandlingMode mode);
         bool getSndFIleNotEmpty();
+        void setPeakResolution(int bits);
+        int getPeakResolution();
+        void setSamplesPerBlock(int frames);
+        int getSamplesPerBlock();
+        int getNumBlocks();
+        bool hasIntervalPeaks();
+        bool exportPeaks(QString filePath);
+        QByteArray exportPeakData(bool json);
+        bool importPeaks(QString filePath);
+        bool importPeakData(const QByteArray &peakData);
+        double blockMin(int block, int channel);
+        double blockMax(int block, int channel);
+        void setProgressCallback(std::function<void(int)> callback);
+        void requestCancel();
+        bool isCancelRequested();
+        size_t memoryUsage();
+        void setExternalMemoryUsage(size_t bytes);
+        void markViewed();
+        void setEvictionHandler(std::function<void()> handler);
+        static void setMemoryBudget(size_t bytes);
+        static size_t getMemoryBudget();
+        static size_t totalMemoryUsage();
+        static void setSharedPeakStoreEnabled(bool enabled);
+        static bool isSharedPeakStoreEnabled();
+        static void setSharedPeakStoreBudget(size_t bytes);
+        static void purgeSharedPeakStore();
+        static void setHelperThreadBudget(std::function<int(int)> reserve, std::function<void(int)> release);
 
 private:
-        double data [MAX_CHANNELS];
         FileHandlingMode fileHandlingMode;
+        bool autoMode;
         QString srcFilePath;
         SNDFILE *sndFile;
+        /* the descriptor under sndFile, for page-cache advice; -1 if libsndfile opened the file itself */
+        int sndFileDescriptor;
+        IOPolicy ioPolicy;
         SF_INFO *sfinfo;
         bool sndFileNotEmpty;
         vector<double> peaks;
-        vector<double> regionPeak;
+        std::atomic<bool> peaksValid;
+        /* FULL_CACHE samples, one contiguous plane of cacheFrames() frames per channel */
         vector<double> fileCache;
-        int readcount;
-        vector<double> dataVector;
+        int peakResolution;
+        int samplesPerBlock;
+        vector<int8_t> blockPeaks8;
+        vector<int16_t> blockPeaks16;
+        /* the block values in use: the data of blockPeaks8 or blockPeaks16, or an entry of the shared peak store */
+        const void *blockData;
+        size_t blockDataValues;
+        /* the resolution and block size blockData was computed with, which the settings may since have left */
+        int blockResolution;
+        int blockFrames;
+        SharedPeakStore sharedPeaks;
+        static std::atomic<bool> sharedPeakStoreEnabled;
+        bool peaksImported;
+        vector<double> spectralBands;
+        int spectralColumns;
+        vector<double> intervalPeaks;
+        std::atomic<bool> intervalPeaksReady;
+        /* per-channel aggregates of every STATISTICS_BLOCK_FRAMES frames, indexed block * channels + channel */
+        vector<BlockStatistics> statisticsBlocks;
+        std::atomic<bool> statisticsReady;
+        std::mutex analysisMutex;
+        std::mutex spectralMutex;
+        /* a pooled libsndfile handle, along with the frame it is positioned at (-1 if unknown) */
+        struct Reader
+        {
+            SNDFILE *file;
+            sf_count_t position;
+            int descriptor;
+        };
+        vector<Reader*> idleReaders;
+        int pooledReaders;
+        std::mutex readerMutex;
+        std::condition_variable readerAvailable;
+        Reader *acquireReader();
+        void releaseReader(Reader *reader);
+        void closeReaders();
         void populateCache();
+        std::atomic<size_t> accountedBytes;
+        std::atomic<size_t> externalBytes;
+        std::atomic<unsigned long long> lastViewed;
+        std::function<void()> evictionHandler;
+        std::atomic<size_t> evictableBytes;
+        std::atomic<bool> evictionPending;
+        static std::mutex registryMutex;
+        static vector<AudioUtil*> registry;
+        static std::atomic<size_t> totalBytes;
+        static std::atomic<size_t> memoryBudget;
+        static std::atomic<unsigned long long> viewClock;
+        static std::mutex helperBudgetMutex;
+        static std::function<int(int)> reserveHelperBudget;
+        static std::function<void(int)> releaseHelperBudget;
+        static int reserveHelpers(int wanted, std::function<void(int)> &release);
+        void init();
+        void updateMemoryUsage();
+        void resolveAutoMode();
+        static void enforceMemoryBudget(AudioUtil *requester);
+        /* the inner loops for the wrapped file's channel count and sample type, chosen when it is opened */
+        const PeakKernels *kernels;
+        void selectKernels();
+        std::function<void(int)> progressCallback;
+        std::atomic<bool> cancelRequested;
+        std::atomic<sf_count_t> framesProcessed;
+        std::atomic<int> lastReportedProgress;
+        void analyzeFile();
+        bool analyzeBlocks(int bits, int framesPerBlock);
+        void computeBlockPeaks();
+        void useStoredBlocks(int bits, int framesPerBlock);
+        bool reopenDecoder();
+        void clearBlockPeaks();
+        double blockValue(size_t index);
+        void closeFile();
+        bool quantizedBlocks(vector<int> &values, int &bits, int &framesPerBlock);
+        vector<double> peakFromBlocks(int region_start_frame, int region_end_frame);
+        bool isCompressedFormat();
+        bool seekReader(Reader *reader, sf_count_t frame);
+        sf_count_t readReader(Reader *reader, double *dest, sf_count_t frameCount);
+        vector<double> peakFromDisk(Reader *reader, int region_start_frame, int region_end_frame);
+        vector<double> peakFromIntervalPeaks(Reader *reader, int region_start_frame, int region_end_frame);
+        void buildIntervalPeaksFromCache();
+        void accumulateBlockStatistics(const double *frames, sf_count_t firstFrame, sf_count_t frameCount, vector<BlockStatistics> &blocks);
+        bool statisticsFromSamples(sf_count_t startFrame, sf_count_t endFrame, BlockStatistics *statistics);
+        sf_count_t cacheFrames();
+        const double *cachePlane(int channel);
+        void truncateCache(sf_count_t frames);
+        void computeBandEnergies(SNDFILE *reader, int firstColumn, int lastColumn, int columns, double *bands);
+        void resetProgress();
+        void reportProgress(sf_count_t frameCount);
+        sf_count_t readFramesInto(SNDFILE *file, sf_count_t startFrame, sf_count_t frameCount, double *dest, int channels, double *channelPeaks = NULL, sf_count_t planeFrames = 0);
+        bool pipelinedScan(sf_count_t bufferFrames, std::function<sf_count_t(double *, sf_count_t)> read, std::function<bool(const double *, sf_count_t)> reduce);
+        SNDFILE *openReader(QString filePath, SF_INFO *info, int *descriptor = NULL);
+        void adviseScan(int descriptor, sf_count_t startFrame, sf_count_t frameCount);
+        void adviseDone(int descriptor);
 
 };
 
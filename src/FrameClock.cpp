@@ -0,0 +1,118 @@
+#include "FrameClock.h"
+
+#include <QGuiApplication>
+#include <QScreen>
+
+#include <algorithm>
+
+/*!
+\file FrameClock.cpp
+\brief FrameClock implementation file.
+*/
+
+FrameClock::FrameClock()
+{
+    this->rate = 0.0;
+    this->timer = new QTimer();
+    this->timer->setTimerType(Qt::PreciseTimer);
+    QObject::connect(this->timer, &QTimer::timeout, [this]() { this->tick(); });
+    this->updateInterval();
+}
+
+/**
+ * \brief The clock shared by every WaveformWidget in the process.
+ */
+FrameClock *FrameClock::instance()
+{
+    static FrameClock clock;
+    return &clock;
+}
+
+/**
+ * \brief Calls callback on every tick until unsubscribe() is called for subscriber.
+ *
+ * Subscribing again replaces the callback.  The clock starts with its first subscriber.
+ *
+ * @param subscriber the object the callback works for
+ * @param callback the work to do on each tick; it may unsubscribe any subscriber, itself included
+ */
+void FrameClock::subscribe(const void *subscriber, std::function<void()> callback)
+{
+    this->subscribers.insert(subscriber, callback);
+    if (!this->timer->isActive())
+    {
+        this->updateInterval();
+        this->timer->start();
+    }
+}
+
+/**
+ * \brief Stops calling the callback of subscriber.  The clock stops with its last subscriber.
+ */
+void FrameClock::unsubscribe(const void *subscriber)
+{
+    this->subscribers.remove(subscriber);
+    if (this->subscribers.isEmpty())
+    {
+        this->timer->stop();
+    }
+}
+
+/**
+ * \brief Whether subscriber is currently called on every tick.
+ */
+bool FrameClock::isSubscribed(const void *subscriber)
+{
+    return this->subscribers.contains(subscriber);
+}
+
+/**
+ * \brief Sets the tick rate, overriding the refresh rate of the primary screen.
+ *
+ * @param hz ticks per second; 0 or less goes back to following the screen
+ */
+void FrameClock::setFrameRate(qreal hz)
+{
+    this->rate = hz;
+    this->updateInterval();
+}
+
+/**
+ * \brief The ticks per second the clock runs at.
+ */
+qreal FrameClock::frameRate()
+{
+    if (this->rate > 0.0)
+    {
+        return this->rate;
+    }
+    QScreen *screen = QGuiApplication::primaryScreen();
+    return screen != nullptr && screen->refreshRate() > 0.0 ? screen->refreshRate() : FRAME_CLOCK_DEFAULT_HZ;
+}
+
+/*
+ * For internal use only!!!  Calls every subscriber once.  Subscribers may come and go from their callbacks, so the
+ * subscribers are listed first and each is looked up again before it is called.
+ */
+void FrameClock::tick()
+{
+    QList<const void *> current = this->subscribers.keys();
+    for (int i = 0; i < current.size(); i++)
+    {
+        QHash<const void *, std::function<void()> >::const_iterator entry = this->subscribers.constFind(current[i]);
+        if (entry != this->subscribers.constEnd())
+        {
+            std::function<void()> callback = entry.value();
+            callback();
+        }
+    }
+}
+
+/*
+ * For internal use only!!!  Sets the timer to the frame interval.  The screen's rate is read again whenever the
+ * clock starts, in case the primary screen has changed in the meantime.
+ */
+void FrameClock::updateInterval()
+{
+    this->timer->setInterval(std::max(1, qRound(1000.0 / this->frameRate())));
+}
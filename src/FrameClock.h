@@ -0,0 +1,51 @@
+#ifndef FRAMECLOCK_H
+#define FRAMECLOCK_H
+
+#include <functional>
+
+#include <QTimer>
+#include <QHash>
+#include <QList>
+
+/*!
+    \file FrameClock.h
+    \brief FrameClock header file
+ */
+
+#define FRAME_CLOCK_DEFAULT_HZ 60.0
+
+using namespace std;
+
+/*!
+\brief The one animation clock every WaveformWidget draws its playback cursor on.
+
+Instead of a timer per widget, the process has a single clock ticking at the refresh rate of the primary screen
+(FRAME_CLOCK_DEFAULT_HZ if that is not known), or at the rate given to setFrameRate().  Widgets subscribe only while
+their value() is changing and unsubscribe once it has settled, and the clock's timer only runs while anyone is
+subscribed, so a window full of idle widgets causes no wakeups at all.  Qt widgets are not told about vertical
+blanks, so the ticks are paced at the refresh interval with a precise timer rather than locked to it.
+
+The clock lives on the GUI thread: subscribe(), unsubscribe() and the callbacks all run there.
+*/
+class FrameClock
+{
+
+public:
+        static FrameClock *instance();
+        void subscribe(const void *subscriber, std::function<void()> callback);
+        void unsubscribe(const void *subscriber);
+        bool isSubscribed(const void *subscriber);
+        void setFrameRate(qreal hz);
+        qreal frameRate();
+
+private:
+        FrameClock();
+        void tick();
+        void updateInterval();
+
+        QTimer *timer;
+        qreal rate;
+        QHash<const void *, std::function<void()> > subscribers;
+};
+
+#endif // FRAMECLOCK_H
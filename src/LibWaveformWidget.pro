@@ -5,18 +5,27 @@ TARGET = build/waveformwidget
 
 TEMPLATE = lib
 
-CONFIG += dll
+CONFIG += dll c++11
 
-QT += widgets concurrent
+QT += widgets
 
 INCLUDEPATH += /usr/include
 
 SOURCES += WaveformWidget.cpp \
-    AudioUtil.cpp 
+    AudioUtil.cpp \
+    AnalysisScheduler.cpp \
+    SharedPeakStore.cpp \
+    FrameClock.cpp
 
 HEADERS += WaveformWidget.h \
     AudioUtil.h \
-    MathUtil.h
+    MathUtil.h \
+    RingBuffer.h \
+    PeakKernels.h \
+    AnalysisScheduler.h \
+    SharedPeakStore.h \
+    FrameClock.h
 
 LIBS += -lsndfile \
+    -lrt \
     -L/usr/lib
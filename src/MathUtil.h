@@ -3,6 +3,8 @@
 #include <math.h>
 #include <stdlib.h>
 #include <vector>
+#include <map>
+#include <mutex>
 
 /*!
     \file MathUtil.h
@@ -12,7 +14,7 @@
 using namespace std;
 
 /*!
-    \brief Contains three simple utility functions leveraged by the WaveformWidget class
+    \brief Contains a few simple utility functions leveraged by the WaveformWidget and AudioUtil classes
 */
 class MathUtil
 {
@@ -53,6 +55,79 @@ public:
       return floor(value + 0.5);
     }
 
+    /*!\brief In-place radix-2 fast Fourier transform of n complex values held as separate real and imaginary arrays.
+
+    n must be a power of two.  Keeping the real and imaginary parts in separate arrays, and reading each stage's
+    twiddle factors from a table laid out stage by stage, leaves the butterfly loop branch-free over unit-stride
+    memory so that the compiler can vectorize it.  The table is computed once per size (see twiddles()).*/
+    static void fft(double *re, double *im, int n)
+    {
+        for (int i = 1, j = 0; i < n; i++)
+        {
+            int bit = n >> 1;
+            for (; j & bit; bit >>= 1)
+                j ^= bit;
+            j ^= bit;
+            if (i < j)
+            {
+                double t = re[i]; re[i] = re[j]; re[j] = t;
+                t = im[i]; im[i] = im[j]; im[j] = t;
+            }
+        }
+
+        const double *table = twiddles(n);
+        for (int len = 2; len <= n; len <<= 1)
+        {
+            int half = len / 2;
+            const double *wr = table + half - 1;
+            const double *wi = table + n + half - 1;
+
+            for (int i = 0; i < n; i += len)
+            {
+                double *aRe = re + i;
+                double *aIm = im + i;
+                double *bRe = re + i + half;
+                double *bIm = im + i + half;
+                for (int k = 0; k < half; k++)
+                {
+                    double tRe = bRe[k] * wr[k] - bIm[k] * wi[k];
+                    double tIm = bRe[k] * wi[k] + bIm[k] * wr[k];
+                    bRe[k] = aRe[k] - tRe;
+                    bIm[k] = aIm[k] - tIm;
+                    aRe[k] += tRe;
+                    aIm[k] += tIm;
+                }
+            }
+        }
+    }
+
+    /*!\brief The twiddle factors of every stage of an n-point fft(), computed on first use and kept for the life of the process.
+
+    The factors of the stage that combines transforms of half points start at index half - 1, the real parts in the
+    first n values and the imaginary parts in the next n.  Tables are never freed or moved once built, so the pointer
+    may be used from any thread.*/
+    static const double *twiddles(int n)
+    {
+        static std::mutex mutex;
+        static std::map<int, vector<double> > tables;
+        std::lock_guard<std::mutex> lock(mutex);
+
+        vector<double> &table = tables[n];
+        if (table.empty())
+        {
+            table.resize(2 * n);
+            for (int half = 1; half < n; half <<= 1)
+            {
+                for (int k = 0; k < half; k++)
+                {
+                    table[half - 1 + k] = cos(-M_PI * k / half);
+                    table[n + half - 1 + k] = sin(-M_PI * k / half);
+                }
+            }
+        }
+        return table.data();
+    }
+
 
 };
 
@@ -0,0 +1,323 @@
+#ifndef PEAKKERNELS_H
+#define PEAKKERNELS_H
+
+#include <sndfile.h>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "MathUtil.h"
+
+/*!
+    \file PeakKernels.h
+    \brief PeakKernels header/implementation file.  Contains the inner loops AudioUtil runs over interleaved frames and channel planes.
+*/
+
+#define CLIP_LEVEL (32767.0 / 32768.0)
+
+using namespace std;
+
+/*!
+\brief Running aggregates of one channel over a run of frames, as kept by AudioUtil for statisticsForRange().
+
+A sample counts as clipped when its magnitude reaches CLIP_LEVEL, the largest positive 16-bit value.
+*/
+struct BlockStatistics
+{
+    double minimum;
+    double maximum;
+    double sum;
+    double sumSquares;
+    sf_count_t clipped;
+    sf_count_t frames;
+
+    BlockStatistics() : minimum(HUGE_VAL), maximum(-HUGE_VAL), sum(0.0), sumSquares(0.0), clipped(0), frames(0) {}
+
+    /*!\brief Folds the aggregates of another run into these.*/
+    void merge(const BlockStatistics &other)
+    {
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+        sum += other.sum;
+        sumSquares += other.sumSquares;
+        clipped += other.clipped;
+        frames += other.frames;
+    }
+};
+
+/*!
+\brief How a sample type is read from libsndfile and scaled to the normalized [-1, 1] range.
+
+AudioUtil opens every handle with SFC_SET_NORM_DOUBLE, under which libsndfile divides 16-bit samples by 32768 and
+passes float samples through, so reading the native type and scaling it here gives exactly the same values as
+sf_readf_double(), with a half or a quarter of the conversion and copying.
+*/
+template <typename Sample>
+struct SampleFormat;
+
+template <>
+struct SampleFormat<short>
+{
+    static double scale() { return 1.0 / 32768.0; }
+    static sf_count_t read(SNDFILE *file, short *dest, sf_count_t frames) { return sf_readf_short(file, dest, frames); }
+};
+
+template <>
+struct SampleFormat<float>
+{
+    static double scale() { return 1.0; }
+    static sf_count_t read(SNDFILE *file, float *dest, sf_count_t frames) { return sf_readf_float(file, dest, frames); }
+};
+
+template <>
+struct SampleFormat<double>
+{
+    static double scale() { return 1.0; }
+    static sf_count_t read(SNDFILE *file, double *dest, sf_count_t frames) { return sf_readf_double(file, dest, frames); }
+};
+
+/*!
+\brief The peak kernels for one channel layout and on-disk sample type, as a table of plain function pointers.
+
+AudioUtil picks a table with PeakKernels::select() when it opens a file and calls through it from then on, so the
+channel count and sample type are decided once per file rather than once per call.  Each kernel is instantiated
+from PeakKernelsFor, in which a channel count of 1 or 2 is a compile-time constant: the per-channel loop is then
+fully unrolled and the per-frame work is straight-line code.  Any other channel count uses the generic (0)
+instantiation, which reads it at run time.
+*/
+struct PeakKernels
+{
+    /*!\brief Folds the absolute values of interleaved frames into a running per-channel maximum.*/
+    void (*accumulatePeaks)(const double *frames, sf_count_t frameCount, int channels, double *channelPeaks);
+    /*!\brief Folds interleaved frames into a running per-channel peak that keeps the signed value of greatest magnitude.*/
+    void (*foldRegionPeak)(const double *frames, sf_count_t frameCount, int channels, double *regionPeaks);
+    /*!\brief Writes the per-channel (min, max) of interleaved frames, quantized to 8 or 16 bits.*/
+    void (*quantizeBlock)(const double *frames, sf_count_t frameCount, int channels, int bits, int *minMax);
+    /*!\brief Reads up to frameCount frames from a handle in the native sample type and folds them like foldRegionPeak.  Returns the frames read.*/
+    sf_count_t (*readRegionPeak)(SNDFILE *file, sf_count_t frameCount, int channels, double *regionPeaks);
+    /*!\brief Folds interleaved frames into running per-channel statistics.*/
+    void (*accumulateStatistics)(const double *frames, sf_count_t frameCount, int channels, BlockStatistics *statistics);
+
+    static const PeakKernels *select(int channels, int format);
+};
+
+/*!
+\brief The kernels for Channels interleaved channels (0 for a count only known at run time) stored as Sample on disk.
+*/
+template <int Channels, typename Sample>
+struct PeakKernelsFor
+{
+    static int count(int channels)
+    {
+        return Channels > 0 ? Channels : channels;
+    }
+
+    template <typename T>
+    static void foldScaledPeak(const T *frames, sf_count_t frameCount, int channels, double scale, double *regionPeaks)
+    {
+        channels = count(channels);
+        for (sf_count_t i = 0; i < frameCount; i++)
+        {
+            for (int c = 0; c < channels; c++)
+            {
+                double value = frames[i * channels + c] * scale;
+                regionPeaks[c] = fabs(value) > fabs(regionPeaks[c]) ? value : regionPeaks[c];
+            }
+        }
+    }
+
+    static void foldRegionPeak(const double *frames, sf_count_t frameCount, int channels, double *regionPeaks)
+    {
+        foldScaledPeak(frames, frameCount, channels, 1.0, regionPeaks);
+    }
+
+    static void accumulatePeaks(const double *frames, sf_count_t frameCount, int channels, double *channelPeaks)
+    {
+        channels = count(channels);
+        for (sf_count_t i = 0; i < frameCount; i++)
+        {
+            for (int c = 0; c < channels; c++)
+            {
+                channelPeaks[c] = std::max(channelPeaks[c], fabs(frames[i * channels + c]));
+            }
+        }
+    }
+
+    static void quantizeBlock(const double *frames, sf_count_t frameCount, int channels, int bits, int *minMax)
+    {
+        channels = count(channels);
+        double scale = bits == 8 ? 127.0 : 32767.0;
+        for (int c = 0; c < channels; c++)
+        {
+            double lo = frameCount > 0 ? frames[c] : 0.0;
+            double hi = lo;
+            for (sf_count_t i = 1; i < frameCount; i++)
+            {
+                lo = std::min(lo, frames[i * channels + c]);
+                hi = std::max(hi, frames[i * channels + c]);
+            }
+            minMax[2 * c] = (int) std::max(-scale, std::min(scale, MathUtil::round(lo * scale)));
+            minMax[2 * c + 1] = (int) std::max(-scale, std::min(scale, MathUtil::round(hi * scale)));
+        }
+    }
+
+    static sf_count_t readRegionPeak(SNDFILE *file, sf_count_t frameCount, int channels, double *regionPeaks)
+    {
+        /* scratch space private to the calling thread, so concurrent queries never share it */
+        static thread_local vector<Sample> chunk;
+        chunk.resize((size_t) frameCount * count(channels));
+        sf_count_t got = SampleFormat<Sample>::read(file, chunk.data(), frameCount);
+        if (got > 0)
+        {
+            foldScaledPeak(chunk.data(), got, channels, SampleFormat<Sample>::scale(), regionPeaks);
+        }
+        return got;
+    }
+
+    static void accumulateStatistics(const double *frames, sf_count_t frameCount, int channels, BlockStatistics *statistics)
+    {
+        channels = count(channels);
+        for (int c = 0; c < channels; c++)
+        {
+            BlockStatistics &channel = statistics[c];
+            for (sf_count_t i = 0; i < frameCount; i++)
+            {
+                double value = frames[i * channels + c];
+                channel.minimum = value < channel.minimum ? value : channel.minimum;
+                channel.maximum = value > channel.maximum ? value : channel.maximum;
+                channel.sum += value;
+                channel.sumSquares += value * value;
+                channel.clipped += fabs(value) >= CLIP_LEVEL;
+            }
+            channel.frames += frameCount;
+        }
+    }
+
+    static const PeakKernels *table()
+    {
+        static const PeakKernels kernels = {&accumulatePeaks, &foldRegionPeak, &quantizeBlock, &readRegionPeak, &accumulateStatistics};
+        return &kernels;
+    }
+};
+
+/*!
+\brief Kernels over one channel plane of AudioUtil's FULL_CACHE cache, which keeps each channel contiguous.
+
+Every loop runs over unit-stride memory and none depends on the channel count, so they cost the same per channel
+whatever the layout of the file, and the reductions are written so the compiler can vectorize them.
+*/
+struct PlanarKernels
+{
+    /*!\brief The greatest absolute value among count samples, or 0 for none.*/
+    static double maxAbs(const double *samples, sf_count_t count)
+    {
+        double peak = 0.0;
+        for (sf_count_t i = 0; i < count; i++)
+        {
+            double value = fabs(samples[i]);
+            peak = value > peak ? value : peak;
+        }
+        return peak;
+    }
+
+    /*!
+    \brief Folds count samples into a running peak that keeps the signed value of greatest magnitude.
+
+    Gives exactly what PeakKernels::foldRegionPeak gives for the same channel: of several samples of equal magnitude
+    the first one wins.  The magnitude is found with a vectorizable pass, then the sample that has it looked up.
+    */
+    static void foldPeak(const double *samples, sf_count_t count, double *regionPeak)
+    {
+        double peak = maxAbs(samples, count);
+        if (peak <= fabs(*regionPeak))
+        {
+            return;
+        }
+        for (sf_count_t i = 0; i < count; i++)
+        {
+            if (fabs(samples[i]) == peak)
+            {
+                *regionPeak = samples[i];
+                return;
+            }
+        }
+    }
+
+    /*!\brief Writes the (min, max) of count samples, quantized to 8 or 16 bits, like PeakKernels::quantizeBlock.*/
+    static void quantize(const double *samples, sf_count_t count, int bits, int *minMax)
+    {
+        double scale = bits == 8 ? 127.0 : 32767.0;
+        double lo = count > 0 ? samples[0] : 0.0;
+        double hi = lo;
+        for (sf_count_t i = 1; i < count; i++)
+        {
+            lo = samples[i] < lo ? samples[i] : lo;
+            hi = samples[i] > hi ? samples[i] : hi;
+        }
+        minMax[0] = (int) std::max(-scale, std::min(scale, MathUtil::round(lo * scale)));
+        minMax[1] = (int) std::max(-scale, std::min(scale, MathUtil::round(hi * scale)));
+    }
+
+    /*!\brief Folds count samples of one channel into its running statistics.*/
+    static void accumulateStatistics(const double *samples, sf_count_t count, BlockStatistics *statistics)
+    {
+        double lo = statistics->minimum;
+        double hi = statistics->maximum;
+        double sum = 0.0;
+        double sumSquares = 0.0;
+        sf_count_t clipped = 0;
+        for (sf_count_t i = 0; i < count; i++)
+        {
+            double value = samples[i];
+            lo = value < lo ? value : lo;
+            hi = value > hi ? value : hi;
+            sum += value;
+            sumSquares += value * value;
+            clipped += fabs(value) >= CLIP_LEVEL;
+        }
+        statistics->minimum = lo;
+        statistics->maximum = hi;
+        statistics->sum += sum;
+        statistics->sumSquares += sumSquares;
+        statistics->clipped += clipped;
+        statistics->frames += count;
+    }
+
+    /*!\brief Copies frameCount interleaved frames into channel planes planeFrames apart, starting at planes.*/
+    static void deinterleave(const double *frames, sf_count_t frameCount, int channels, double *planes, sf_count_t planeFrames)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            double *plane = planes + c * planeFrames;
+            for (sf_count_t i = 0; i < frameCount; i++)
+            {
+                plane[i] = frames[i * channels + c];
+            }
+        }
+    }
+};
+
+/*!
+\brief The table for a file with the given channel count and libsndfile format.
+
+16-bit PCM is read as short and float files as float; every other format is read as double, the type libsndfile
+converts it to anyway.
+*/
+inline const PeakKernels *PeakKernels::select(int channels, int format)
+{
+    switch (format & SF_FORMAT_SUBMASK)
+    {
+        case SF_FORMAT_PCM_16:
+            return channels == 1 ? PeakKernelsFor<1, short>::table()
+                 : channels == 2 ? PeakKernelsFor<2, short>::table() : PeakKernelsFor<0, short>::table();
+        case SF_FORMAT_FLOAT:
+            return channels == 1 ? PeakKernelsFor<1, float>::table()
+                 : channels == 2 ? PeakKernelsFor<2, float>::table() : PeakKernelsFor<0, float>::table();
+        default:
+            return channels == 1 ? PeakKernelsFor<1, double>::table()
+                 : channels == 2 ? PeakKernelsFor<2, double>::table() : PeakKernelsFor<0, double>::table();
+    }
+}
+
+#endif // PEAKKERNELS_H
@@ -0,0 +1,90 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stdlib.h>
+#include <atomic>
+#include <vector>
+
+/*!
+    \file RingBuffer.h
+    \brief RingBuffer header/implementation file.  Contains a lock-free single-producer/single-consumer queue.
+*/
+
+using namespace std;
+
+/*!
+\brief A wait-free single-producer/single-consumer ring buffer.
+
+All storage is allocated by the constructor, so write() and read() never allocate, lock or block.  Exactly one
+thread may call write() and exactly one (other) thread may call read(); this makes the buffer suitable for handing
+data out of a real-time audio callback.  The capacity is rounded up to a power of two.
+*/
+template <typename T>
+class RingBuffer
+{
+public:
+    /*!\brief Constructs a ring buffer able to hold at least capacity items.*/
+    explicit RingBuffer(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        this->buffer.resize(size);
+        this->mask = size - 1;
+        this->head = 0;
+        this->tail = 0;
+    }
+
+    /*!\brief The number of items the buffer can hold.*/
+    size_t capacity() const
+    {
+        return this->buffer.size();
+    }
+
+    /*!\brief Producer side: the number of items that can currently be written.*/
+    size_t writeAvailable() const
+    {
+        return this->capacity() - (this->head.load(memory_order_relaxed) - this->tail.load(memory_order_acquire));
+    }
+
+    /*!\brief Consumer side: the number of items that can currently be read.*/
+    size_t readAvailable() const
+    {
+        return this->head.load(memory_order_acquire) - this->tail.load(memory_order_relaxed);
+    }
+
+    /*!\brief Producer side: appends up to count items, and returns how many were actually written.*/
+    size_t write(const T *items, size_t count)
+    {
+        size_t h = this->head.load(memory_order_relaxed);
+        size_t available = this->capacity() - (h - this->tail.load(memory_order_acquire));
+        if (count > available)
+            count = available;
+        for (size_t i = 0; i < count; i++)
+            this->buffer[(h + i) & this->mask] = items[i];
+        this->head.store(h + count, memory_order_release);
+        return count;
+    }
+
+    /*!\brief Consumer side: removes up to count items into items, and returns how many were actually read.*/
+    size_t read(T *items, size_t count)
+    {
+        size_t t = this->tail.load(memory_order_relaxed);
+        size_t available = this->head.load(memory_order_acquire) - t;
+        if (count > available)
+            count = available;
+        for (size_t i = 0; i < count; i++)
+            items[i] = this->buffer[(t + i) & this->mask];
+        this->tail.store(t + count, memory_order_release);
+        return count;
+    }
+
+private:
+    vector<T> buffer;
+    size_t mask;
+    /* the indices only ever grow; they are kept on separate cache lines so producer and consumer do not contend */
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+};
+
+#endif // RINGBUFFER_H
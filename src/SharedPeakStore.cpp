@@ -0,0 +1,552 @@
+#include "SharedPeakStore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*!
+\file SharedPeakStore.cpp
+\brief SharedPeakStore implementation file.
+*/
+
+#define SHARED_PEAKS_MAGIC 0x57575033u
+
+/* the state and lease are read and written by several processes through their own mappings, which needs lock-free atomics */
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the shared peak store needs lock-free 32-bit atomics");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the shared peak store needs lock-free 64-bit atomics");
+
+std::atomic<size_t> SharedPeakStore::storeBudget(DEFAULT_SHARED_PEAKS_BUDGET);
+
+/*
+ * For internal use only!!!  The start of an entry.  It is followed by channels doubles holding the per-channel
+ * peaks, the canonical path (padded to 8 bytes), valueCount block values of bits / 8 bytes each (padded to 8 bytes)
+ * and statisticsCount statistics blocks.
+ */
+struct SharedPeakStore::Header
+{
+    std::atomic<uint32_t> state;
+    uint32_t magic;
+    /* milliseconds since the epoch after which a WRITING entry is taken to be abandoned */
+    std::atomic<int64_t> leaseExpires;
+    int32_t channels;
+    int64_t frames;
+    int32_t samplesPerBlock;
+    int32_t bits;
+    uint64_t valueCount;
+    uint64_t statisticsCount;
+    uint64_t pathLength;
+};
+
+/*
+ * For internal use only!!!  64-bit FNV-1a, to turn the key of an entry into a shared memory object name.
+ */
+static uint64_t hashKey(const std::string &key)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < key.size(); i++)
+    {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static size_t padded(size_t bytes)
+{
+    return (bytes + 7) & ~(size_t) 7;
+}
+
+/*
+ * For internal use only!!!  The wall-clock time in milliseconds since the epoch, which unlike a process ID or the
+ * monotonic clock means the same to every process on the machine.
+ */
+static int64_t wallClockMs()
+{
+    return (int64_t) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * For internal use only!!!  Unlinks the entry called name if it is still the object that was found stale, and not
+ * one created under the same name since.
+ */
+static void unlinkStale(const char *name, const struct stat &stale)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+    {
+        return;
+    }
+    struct stat current;
+    if (fstat(fd, &current) == 0 && current.st_dev == stale.st_dev && current.st_ino == stale.st_ino)
+    {
+        shm_unlink(name);
+    }
+    close(fd);
+}
+
+/*
+ * For internal use only!!!  An entry of the store found on disk.
+ */
+struct StoredEntry
+{
+    std::string name;
+    int64_t lastUsed;
+    size_t bytes;
+};
+
+/*
+ * For internal use only!!!  Lists the entries of the store owned by this process's user.  Readers touch an entry
+ * whenever they map it, so its modification time is when it was last used.
+ */
+static std::vector<StoredEntry> storedEntries()
+{
+    std::vector<StoredEntry> entries;
+    DIR *dir = opendir(SHARED_PEAKS_DIR);
+    if (dir == NULL)
+    {
+        return entries;
+    }
+    /* names under the directory lack the leading slash of shm_open() names */
+    const char *prefix = SHARED_PEAKS_PREFIX + 1;
+    size_t prefixLength = strlen(prefix);
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL)
+    {
+        struct stat status;
+        if (strncmp(item->d_name, prefix, prefixLength) == 0 && fstatat(dirfd(dir), item->d_name, &status, AT_SYMLINK_NOFOLLOW) == 0
+            && S_ISREG(status.st_mode) && status.st_uid == geteuid())
+        {
+            StoredEntry entry;
+            entry.name = std::string("/") + item->d_name;
+            entry.lastUsed = (int64_t) status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+            entry.bytes = (size_t) status.st_size;
+            entries.push_back(entry);
+        }
+    }
+    closedir(dir);
+    return entries;
+}
+
+SharedPeakStore::SharedPeakStore()
+{
+    this->header = NULL;
+    this->mappedBytes = 0;
+    this->writer = false;
+}
+
+SharedPeakStore::~SharedPeakStore()
+{
+    this->release();
+}
+
+/**
+ * \brief Finds or creates the entry for a file.
+ *
+ * Returns true once the entry is either ready to read (isReady()) or created by this process, which must then
+ * analyze the file, renew() its lease while doing so, and publish() or abandon() it (isWriter()).  While another
+ * process is writing the entry this waits for it, polling every SHARED_PEAKS_POLL_MS milliseconds, until cancelled
+ * returns true or the writer's lease runs out.  Returns false if the store cannot be used for the file, in which
+ * case the caller analyzes it on its own.
+ *
+ * @param filePath the file the peaks are computed from
+ * @param channels its channel count
+ * @param frames its length in frames
+ * @param samplesPerBlock frames per block
+ * @param bits 8 or 16, the resolution of the block values
+ * @param statisticsCount the number of statistics blocks that go with them
+ * @param cancelled polled while waiting; returning true gives up
+ */
+bool SharedPeakStore::acquire(QString filePath, int channels, sf_count_t frames, int samplesPerBlock, int bits, size_t statisticsCount, std::function<bool()> cancelled)
+{
+    this->release();
+
+    std::string source = filePath.toStdString();
+    char resolved[PATH_MAX];
+    struct stat status;
+    if (realpath(source.c_str(), resolved) == NULL || stat(resolved, &status) == -1)
+    {
+        return false;
+    }
+    std::string path(resolved);
+
+    char key[128];
+    /* the magic is part of the key, so entries of an older layout are never opened */
+    snprintf(key, sizeof(key), "\n%lld.%09ld\n%lld\n%d\n%d\n%x", (long long) status.st_mtim.tv_sec, (long) status.st_mtim.tv_nsec,
+             (long long) status.st_size, samplesPerBlock, bits, SHARED_PEAKS_MAGIC);
+    char name[64];
+    snprintf(name, sizeof(name), "%s%016llx", SHARED_PEAKS_PREFIX, (unsigned long long) hashKey(path + key));
+    this->name = QString(name);
+
+    size_t valueCount = (size_t) ((frames + samplesPerBlock - 1) / samplesPerBlock) * channels * 2;
+    size_t bytes = this->expectedBytes(channels, valueCount, bits, statisticsCount, path.size());
+
+    for (int attempt = 0; attempt < SHARED_PEAKS_MAX_ATTEMPTS && !cancelled(); attempt++)
+    {
+        /* whoever creates the entry analyzes the file */
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd != -1)
+        {
+            void *mapping = MAP_FAILED;
+            if (ftruncate(fd, (off_t) bytes) == 0)
+            {
+                mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if (mapping == MAP_FAILED)
+            {
+                perror("err in SharedPeakStore::acquire -- could not size or map a new entry");
+                shm_unlink(name);
+                return false;
+            }
+            this->header = (Header *) mapping;
+            this->mappedBytes = bytes;
+            this->writer = true;
+            this->header->magic = SHARED_PEAKS_MAGIC;
+            this->header->leaseExpires.store(wallClockMs() + SHARED_PEAKS_LEASE_MS, std::memory_order_relaxed);
+            this->header->channels = channels;
+            this->header->frames = frames;
+            this->header->samplesPerBlock = samplesPerBlock;
+            this->header->bits = bits;
+            this->header->valueCount = valueCount;
+            this->header->statisticsCount = statisticsCount;
+            this->header->pathLength = path.size();
+            memcpy((char *) mapping + sizeof(Header) + channels * sizeof(double), path.data(), path.size());
+            this->header->state.store(WRITING, std::memory_order_release);
+            trim(name);
+            return true;
+        }
+        if (errno != EEXIST)
+        {
+            return false;
+        }
+
+        fd = shm_open(name, O_RDONLY, 0);
+        if (fd == -1)
+        {
+            /* unlinked in the meantime: try to create it again */
+            if (errno == ENOENT)
+            {
+                continue;
+            }
+            return false;
+        }
+        /* anyone could have created an entry under a predictable name: only this user's own are trusted */
+        struct stat entryStatus;
+        if (fstat(fd, &entryStatus) == -1 || entryStatus.st_uid != geteuid())
+        {
+            close(fd);
+            return false;
+        }
+
+        /* an entry being sized by its creator is waited for, until its creator is taken to have died */
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        bool stale = false;
+        while (entryStatus.st_size == 0 && !stale)
+        {
+            if (cancelled())
+            {
+                close(fd);
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(SHARED_PEAKS_POLL_MS));
+            if (fstat(fd, &entryStatus) == -1)
+            {
+                close(fd);
+                return false;
+            }
+            stale = entryStatus.st_size == 0
+                && std::chrono::steady_clock::now() - started > std::chrono::milliseconds(SHARED_PEAKS_EMPTY_TIMEOUT_MS);
+        }
+        if (stale)
+        {
+            unlinkStale(name, entryStatus);
+            close(fd);
+            continue;
+        }
+
+        /* one of another size is a hash collision */
+        void *mapping = MAP_FAILED;
+        if ((size_t) entryStatus.st_size == bytes)
+        {
+            mapping = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (mapping == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        this->header = (Header *) mapping;
+        this->mappedBytes = bytes;
+
+        for (;;)
+        {
+            uint32_t state = this->header->state.load(std::memory_order_acquire);
+            if (state == READY)
+            {
+                bool found = this->matches(channels, frames, samplesPerBlock, bits, statisticsCount, path);
+                if (found)
+                {
+                    /* marks the entry used, for trim() */
+                    futimens(fd, NULL);
+                }
+                else
+                {
+                    this->unmap();
+                }
+                close(fd);
+                return found;
+            }
+            if (state == FAILED)
+            {
+                break;
+            }
+            if ((state == WRITING && this->header->leaseExpires.load(std::memory_order_relaxed) < wallClockMs())
+                || (state == EMPTY && std::chrono::steady_clock::now() - started > std::chrono::milliseconds(SHARED_PEAKS_EMPTY_TIMEOUT_MS)))
+            {
+                /* the creator died without publishing */
+                unlinkStale(name, entryStatus);
+                break;
+            }
+            if (cancelled())
+            {
+                this->unmap();
+                close(fd);
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(SHARED_PEAKS_POLL_MS));
+        }
+        this->unmap();
+        close(fd);
+    }
+    return false;
+}
+
+/**
+ * \brief Whether the entry holds published peaks that channelPeaks() and values() may be read from.
+ */
+bool SharedPeakStore::isReady()
+{
+    return this->header != NULL && this->header->state.load(std::memory_order_acquire) == READY;
+}
+
+/**
+ * \brief Whether this process created the entry and still has to publish() or abandon() it.
+ */
+bool SharedPeakStore::isWriter()
+{
+    return this->writer;
+}
+
+/**
+ * \brief Extends the writer's lease on its entry by SHARED_PEAKS_LEASE_MS from now.
+ *
+ * A writer must call this at least that often while it analyzes the file, or other processes will take the entry
+ * to be abandoned.  Does nothing unless this process is the writer.
+ */
+void SharedPeakStore::renew()
+{
+    if (this->writer)
+    {
+        this->header->leaseExpires.store(wallClockMs() + SHARED_PEAKS_LEASE_MS, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * \brief Writes the analysis of the file into the entry and marks it ready for every process.
+ *
+ * @param channelPeaks the per-channel peaks, one double per channel
+ * @param values the block values, valueCount() of them in the resolution given to acquire()
+ * @param statistics the statistics blocks, statisticsCount() of them
+ * @return true if the entry was published
+ */
+bool SharedPeakStore::publish(const double *channelPeaks, const void *values, const BlockStatistics *statistics)
+{
+    if (!this->writer)
+    {
+        return false;
+    }
+    char *base = (char *) this->header;
+    size_t peaksBytes = this->header->channels * sizeof(double);
+    memcpy(base + sizeof(Header), channelPeaks, peaksBytes);
+    memcpy(base + sizeof(Header) + padded(peaksBytes + this->header->pathLength), values,
+           (size_t) this->header->valueCount * (this->header->bits / 8));
+    memcpy(base + this->statisticsOffset(), statistics, (size_t) this->header->statisticsCount * sizeof(BlockStatistics));
+    this->header->state.store(READY, std::memory_order_release);
+    this->writer = false;
+    return true;
+}
+
+/**
+ * \brief Gives up on an entry this process created, so that the next process to need it tries again.
+ */
+void SharedPeakStore::abandon()
+{
+    if (this->writer)
+    {
+        this->header->state.store(FAILED, std::memory_order_release);
+        shm_unlink(this->name.toStdString().c_str());
+        this->writer = false;
+    }
+    this->unmap();
+}
+
+/**
+ * \brief Unmaps the entry.  The entry itself stays in the store; one still being written is abandoned.
+ */
+void SharedPeakStore::release()
+{
+    if (this->writer)
+    {
+        this->abandon();
+    }
+    this->unmap();
+}
+
+/**
+ * \brief The published per-channel peaks.
+ */
+const double *SharedPeakStore::channelPeaks()
+{
+    return (const double *) ((const char *) this->header + sizeof(Header));
+}
+
+/**
+ * \brief The published block values, int8_t or int16_t depending on the resolution.
+ */
+const void *SharedPeakStore::values()
+{
+    return (const char *) this->header + sizeof(Header) + padded(this->header->channels * sizeof(double) + this->header->pathLength);
+}
+
+/**
+ * \brief The number of block values in the entry.
+ */
+size_t SharedPeakStore::valueCount()
+{
+    return this->header != NULL ? (size_t) this->header->valueCount : 0;
+}
+
+/**
+ * \brief The published statistics blocks, in the order AudioUtil keeps them.
+ */
+const BlockStatistics *SharedPeakStore::statistics()
+{
+    return (const BlockStatistics *) ((const char *) this->header + this->statisticsOffset());
+}
+
+/**
+ * \brief The number of statistics blocks in the entry.
+ */
+size_t SharedPeakStore::statisticsCount()
+{
+    return this->header != NULL ? (size_t) this->header->statisticsCount : 0;
+}
+
+/**
+ * \brief Sets the number of bytes the entries of this user should stay within.  The default is
+ * DEFAULT_SHARED_PEAKS_BUDGET.
+ *
+ * The budget is applied whenever an entry is created, and only by this process: other processes apply their own.
+ */
+void SharedPeakStore::setBudget(size_t bytes)
+{
+    storeBudget = bytes;
+}
+
+/**
+ * \brief The number of bytes the entries of this user should stay within.
+ */
+size_t SharedPeakStore::budget()
+{
+    return storeBudget;
+}
+
+/**
+ * \brief Unlinks every entry of this user, so that the store takes no memory beyond what is still mapped.
+ */
+void SharedPeakStore::purge()
+{
+    std::vector<StoredEntry> entries = storedEntries();
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        shm_unlink(entries[i].name.c_str());
+    }
+}
+
+/*
+ * For internal use only!!!  Unlinks the least recently used entries of this user until they fit in the budget,
+ * sparing the entry called keep.
+ */
+void SharedPeakStore::trim(const char *keep)
+{
+    std::vector<StoredEntry> entries = storedEntries();
+    size_t total = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        total += entries[i].bytes;
+    }
+    std::sort(entries.begin(), entries.end(), [](const StoredEntry &a, const StoredEntry &b) { return a.lastUsed < b.lastUsed; });
+    for (size_t i = 0; i < entries.size() && total > storeBudget; i++)
+    {
+        if (entries[i].name != keep)
+        {
+            shm_unlink(entries[i].name.c_str());
+            total -= entries[i].bytes;
+        }
+    }
+}
+
+/*
+ * For internal use only!!!  The size of an entry, which readers check before mapping it.
+ */
+size_t SharedPeakStore::expectedBytes(int channels, size_t valueCount, int bits, size_t statisticsCount, size_t pathLength)
+{
+    return sizeof(Header) + padded(channels * sizeof(double) + pathLength) + padded(valueCount * (bits / 8))
+        + statisticsCount * sizeof(BlockStatistics);
+}
+
+/*
+ * For internal use only!!!  Where the statistics blocks start, past the block values.
+ */
+size_t SharedPeakStore::statisticsOffset()
+{
+    return sizeof(Header) + padded(this->header->channels * sizeof(double) + this->header->pathLength)
+        + padded((size_t) this->header->valueCount * (this->header->bits / 8));
+}
+
+/*
+ * For internal use only!!!  Whether a published entry is the one asked for rather than one whose name collides.
+ */
+bool SharedPeakStore::matches(int channels, sf_count_t frames, int samplesPerBlock, int bits, size_t statisticsCount, const std::string &path)
+{
+    const char *storedPath = (const char *) this->header + sizeof(Header) + channels * sizeof(double);
+    return this->header->magic == SHARED_PEAKS_MAGIC && this->header->channels == channels && this->header->frames == frames
+        && this->header->samplesPerBlock == samplesPerBlock && this->header->bits == bits && this->header->statisticsCount == statisticsCount
+        && this->header->pathLength == path.size() && memcmp(storedPath, path.data(), path.size()) == 0;
+}
+
+/*
+ * For internal use only!!!  Drops this process's mapping of the entry.
+ */
+void SharedPeakStore::unmap()
+{
+    if (this->header != NULL)
+    {
+        munmap(this->header, this->mappedBytes);
+    }
+    this->header = NULL;
+    this->mappedBytes = 0;
+    this->writer = false;
+}
@@ -0,0 +1,91 @@
+#ifndef SHAREDPEAKSTORE_H
+#define SHAREDPEAKSTORE_H
+
+#include <sndfile.h>
+#include "PeakKernels.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <QString>
+
+/*!
+    \file SharedPeakStore.h
+    \brief SharedPeakStore header file
+ */
+
+#define SHARED_PEAKS_PREFIX "/waveformwidget-peaks-"
+#define SHARED_PEAKS_DIR "/dev/shm"
+#define SHARED_PEAKS_POLL_MS 10
+#define SHARED_PEAKS_EMPTY_TIMEOUT_MS 1000
+#define SHARED_PEAKS_LEASE_MS 10000
+#define SHARED_PEAKS_MAX_ATTEMPTS 8
+#define DEFAULT_SHARED_PEAKS_BUDGET ((size_t) 256 * 1024 * 1024)
+
+using namespace std;
+
+/*!
+\brief One entry of a POSIX shared-memory store of PEAKS_ONLY block peaks, shared by every process on the machine.
+
+An entry is a shared memory object named after a hash of the file's canonical path, modification time and size,
+and of the block size and resolution, so it goes stale by itself when the file is modified.  The first process to
+need the peaks of a file creates the entry (shm_open() with O_CREAT | O_EXCL, so exactly one process wins), analyzes
+the file and publishes the result (the block peaks, along with the statistics blocks AudioUtil::statisticsForRange()
+works from); every other process maps the entry read-only and uses the blocks in place, so
+each file is decoded once and its blocks held in memory once however many processes display it.
+
+Publication is lock-free: the entry begins with an atomic state that goes from EMPTY (just created) to WRITING (the
+metadata is in place) to READY (the data is complete) with release stores, and readers only touch the data once
+they have loaded READY with acquire ordering.  A writer holds a lease on its entry, a wall-clock deadline it pushes
+SHARED_PEAKS_LEASE_MS ahead with renew() while it analyzes; the clock is shared by every process on the machine,
+whatever PID namespace they run in.  A process that sees WRITING waits for the writer until the lease runs out, and
+one that sees EMPTY waits SHARED_PEAKS_EMPTY_TIMEOUT_MS; either way the entry is then taken to belong to a dead
+process, unlinked, and analysis starts over.  A writer that gives up marks the entry FAILED and unlinks it.
+
+Entries are created readable and writable by their owner only, and entries owned by another user are never used.
+They outlive the processes that made them, and live in RAM (under SHARED_PEAKS_DIR, with the SHARED_PEAKS_PREFIX
+prefix), so the store is kept to a budget: each new entry unlinks the least recently used entries of the same user
+until they all fit in budget().  purge() unlinks them all.  Processes that have an entry mapped keep using it after
+it has been unlinked.  AudioUtil uses the store in PEAKS_ONLY mode once it has been enabled with
+AudioUtil::setSharedPeakStoreEnabled().
+*/
+class SharedPeakStore
+{
+
+public:
+        enum State {EMPTY, WRITING, READY, FAILED};
+        SharedPeakStore();
+        ~SharedPeakStore();
+        bool acquire(QString filePath, int channels, sf_count_t frames, int samplesPerBlock, int bits, size_t statisticsCount, std::function<bool()> cancelled);
+        bool isReady();
+        bool isWriter();
+        void renew();
+        bool publish(const double *channelPeaks, const void *values, const BlockStatistics *statistics);
+        void abandon();
+        void release();
+        const double *channelPeaks();
+        const void *values();
+        size_t valueCount();
+        const BlockStatistics *statistics();
+        size_t statisticsCount();
+        static void setBudget(size_t bytes);
+        static size_t budget();
+        static void purge();
+
+private:
+        struct Header;
+
+        QString name;
+        Header *header;
+        size_t mappedBytes;
+        bool writer;
+        static std::atomic<size_t> storeBudget;
+        size_t expectedBytes(int channels, size_t valueCount, int bits, size_t statisticsCount, size_t pathLength);
+        size_t statisticsOffset();
+        bool matches(int channels, sf_count_t frames, int samplesPerBlock, int bits, size_t statisticsCount, const std::string &path);
+        void unmap();
+        static void trim(const char *keep);
+};
+
+#endif // SHAREDPEAKSTORE_H
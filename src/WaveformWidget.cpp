@@ -5,13 +5,22 @@
 #include <QToolTip>
 #include <QDebug>
 #include <QThread>
-#include <QtConcurrent>
+#include <QCoreApplication>
+#include <QStringList>
+#include <QtMath>
 
 #define DEFAULT_PADDING 0.3
 #define LINE_WIDTH 1
 #define POINT_SIZE 5
 #define DEFAULT_COLOR Qt::blue
 #define INDIVIDUAL_SAMPLE_DRAW_TOGGLE_POINT 9.0
+#define LIVE_DRAIN_INTERVAL_MS 30
+#define LIVE_SCRATCH_FRAMES 4096
+#define DEFAULT_RELEASE_DELAY_MS 30000
+#define PEAK_CACHE_ENTRIES 16
+#define PREFETCH_MAX_PENDING 8
+#define SPECTRAL_MAX_FILE_COLUMNS 32768
+#define FRAME_CLOCK_IDLE_FRAMES 30
 
 /*!
 \file WaveformWidget.cpp
@@ -41,39 +50,181 @@ WaveformWidget::WaveformWidget(QWidget *parent) : QAbstractSlider(parent),
     clearFocus();
     setFocusPolicy(Qt::NoFocus);
 
-    this->m_srcAudioFile = new AudioUtil();
-    this->m_pixMapLabel = new QLabel(this);
-    this->m_pixMapLabel->show();
+    this->m_srcAudioFile = QSharedPointer<AudioUtil>(new AudioUtil());
+    this->m_currentFileHandlingMode = AUTO;
+    this->m_renderMode = PEAK_MODE;
+    this->m_loadGeneration = 0;
+    this->m_analysisPriority = ANALYSIS_PRIORITY_HIDDEN;
+    this->m_isLoading = false;
+    this->m_deferredLoading = false;
+    this->m_loadPending = false;
+    this->m_loadDevice = ANALYSIS_NO_DEVICE;
+    this->m_batchLoad = false;
+    this->m_releaseTimer = new QTimer(this);
+    this->m_releaseTimer->setSingleShot(true);
+    this->m_releaseTimer->setInterval(DEFAULT_RELEASE_DELAY_MS);
+    connect(this->m_releaseTimer, &QTimer::timeout, this, &WaveformWidget::releaseHidden);
+    this->m_visibleStart = 0;
+    this->m_visibleEnd = 0;
+    this->m_navigationDirection = NO_DIRECTION;
+    this->m_prefetchGeneration = 0;
+    this->m_prefetchesRunning = 0;
+    this->m_redrawRequired = false;
+    this->m_releasePending = false;
+    this->m_padding = DEFAULT_PADDING;
+    this->m_scaleFactor = -1.0;
+    this->m_lastDrawnColumn = -1;
+    this->m_drawQueued = false;
+    this->m_idleFrames = 0;
+    this->m_isClickHold = false;
+    this->m_updateBreakPointRequired = false;
+    this->m_hasBreakPoint = false;
+    this->m_breakPointPos = 0;
+    this->m_isLive = false;
+    this->m_liveInput = NULL;
+    this->m_livePublished = 0;
+    this->m_liveAcknowledged = 0;
+    this->m_liveChannels = 0;
+    this->m_liveSampleRate = 0;
+    this->m_liveWindowSeconds = 0.0;
+    this->m_liveColumnHead = 0;
+    this->m_liveColumnCount = 0;
+    this->m_liveFramesInColumn = 0;
+    this->m_liveOverrunFrames = 0;
+    this->m_liveOverrunEvents = 0;
+    this->m_liveTimer = new QTimer(this);
+    connect(this->m_liveTimer, &QTimer::timeout, this, &WaveformWidget::drainLiveInput);
+    this->m_liveTimer->setInterval(LIVE_DRAIN_INTERVAL_MS);
+    this->m_isRendering = false;
+    this->m_renderGeneration = 0;
     this->m_shouldRecalculatePeaks = true;
     this->m_isRecalculatingPeaks = false;
-    this->m_paintTimer = new QTimer(this);
-    connect(this->m_paintTimer, &QTimer::timeout, this, &WaveformWidget::overviewDraw);
-    m_paintTimer->setInterval(100);
-    m_paintTimer->start();
 }
 
-/*The AudioUtil instance "m_srcAudioFile" is our only dynamically allocated object*/
+/*The AudioUtil instances are shared with worker threads, so queued jobs are dropped and running ones cancelled and waited for*/
 WaveformWidget::~WaveformWidget()
 {
-    delete this->m_srcAudioFile;
+    FrameClock::instance()->unsubscribe(this);
+    this->m_srcAudioFile->setEvictionHandler(std::function<void()>());
+    this->cancelLoad();
+    this->cancelPrefetch();
+    AnalysisScheduler::instance()->cancel(&this->m_peakCache);
+    AnalysisScheduler::instance()->cancel(&this->m_frontImage);
+    AnalysisScheduler::instance()->cancel(this);
+    delete this->m_liveInput.load();
+    for (size_t i = 0; i < this->m_liveRetired.size(); i++)
+        delete this->m_liveRetired[i].second;
 }
 
 
+/*!
+\brief Set the audio file to be visualized by this instance of WaveformWidget.
+
+The file is opened and loaded on a worker thread in the current file-handling mode (AUTO unless changed
+with setFileHandlingMode()), so this function returns immediately; see resetFile().
+@param fileName Valid path to an audio file
+*/
 void WaveformWidget::setSource(QFileInfo *fileName)
 {
     if (this->m_hasBreakPoint)
         this->resetBreakPoint();
-    this->m_currentFileHandlingMode = FULL_CACHE;
     this->resetFile(fileName);
     this->m_scaleFactor = -1.0;
     this->m_lastSize = this->size();
     this->m_padding = DEFAULT_PADDING;
 }
 
+/*Owner of the jobs that locate the files of a setSources() batch; they touch no widget, so none waits for them.*/
+static const int sourceBatchOwner = 0;
+
+/*!
+\brief Set the audio files of many widgets at once, reading them in the order they lie on disk.
+
+Like calling setSource() on each widget, except that the files are first located on disk (see
+AudioUtil::locateFile()) on a worker thread, and their loads are then queued by device and physical position rather
+than in the order of the lists.  Every widget draws its placeholder meanwhile.  The loads of a batch go ahead of other
+off-screen work at ANALYSIS_PRIORITY_BATCH, widgets on screen still load first, and each device is read by at most
+AnalysisScheduler::deviceLimit() loads at a time, so a session of hundreds of files on a hard disk or network share is
+read mostly sequentially.  Each widget emits loaded() (or loadFailed()) as its own file is ready.  A widget given
+another source before its turn comes, or destroyed, is skipped.  Deferred loading (see setDeferredLoading()) is
+honored.
+@param widgets The widgets to set
+@param files Valid paths to audio files, one for each widget
+*/
+void WaveformWidget::setSources(const QList<WaveformWidget *> &widgets, const QList<QFileInfo> &files)
+{
+    QList<QPointer<WaveformWidget> > targets;
+    QList<int> generations;
+    QStringList paths;
+    for (int i = 0; i < std::min(widgets.size(), files.size()); i++)
+    {
+        if (widgets[i] == nullptr)
+            continue;
+        widgets[i]->prepareBatchSource(files[i].canonicalFilePath());
+        targets.append(widgets[i]);
+        generations.append(widgets[i]->m_loadGeneration);
+        paths.append(widgets[i]->m_audioFilePath);
+    }
+
+    AnalysisScheduler::instance()->submit(&sourceBatchOwner, [targets, generations, paths]()
+    {
+        vector<AudioUtil::FileLocation> locations;
+        vector<int> order;
+        for (int i = 0; i < paths.size(); i++)
+        {
+            locations.push_back(AudioUtil::locateFile(paths[i]));
+            order.push_back(i);
+        }
+        /*files that could not be located keep their place behind the others; their loads fail on their own*/
+        std::stable_sort(order.begin(), order.end(), [&locations](int a, int b)
+        {
+            if (locations[a].valid != locations[b].valid)
+                return locations[a].valid;
+            return locations[a].valid && locations[a] < locations[b];
+        });
+
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [targets, generations, locations, order]()
+        {
+            for (size_t i = 0; i < order.size(); i++)
+            {
+                WaveformWidget *widget = targets[order[i]].data();
+                if (widget == nullptr || widget->m_loadGeneration != generations[order[i]])
+                    continue;
+                const AudioUtil::FileLocation &location = locations[order[i]];
+                widget->m_loadDevice = location.valid ? (qint64) location.device : ANALYSIS_NO_DEVICE;
+                widget->m_batchLoad = true;
+                widget->requestLoad();
+            }
+        }, Qt::QueuedConnection);
+    }, ANALYSIS_PRIORITY_VISIBLE);
+}
+
+/*
+    Sets the source of a widget for setSources(), and shows the placeholder until the batch starts its load.
+    The widget counts as loading meanwhile, so that it does not start the load on its own.
+*/
+void WaveformWidget::prepareBatchSource(const QString &filePath)
+{
+    if (this->m_hasBreakPoint)
+        this->resetBreakPoint();
+    this->m_audioFilePath = filePath;
+    this->m_peakFilePath.clear();
+    this->m_peakData.clear();
+    this->m_loadDevice = ANALYSIS_NO_DEVICE;
+    this->m_batchLoad = false;
+    this->m_scaleFactor = -1.0;
+    this->m_lastSize = this->size();
+    this->m_padding = DEFAULT_PADDING;
+    this->unloadSource();
+    this->m_loadPending = false;
+    this->m_isLoading = true;
+}
+
 void WaveformWidget::resetBreakPoint()
 {
     m_updateBreakPointRequired = true;
     m_hasBreakPoint = false;
+    this->requestDraw();
     emit breakPointRemoved();
 }
 
@@ -81,6 +232,7 @@ void WaveformWidget::setBreakPoint(int pos)
 {
     m_breakPointPos = pos / (maximum() / width());
     m_updateBreakPointRequired = true;
+    this->requestDraw();
     emit breakPointSet(pos * (maximum() / width()));
 }
 
@@ -102,6 +254,7 @@ void WaveformWidget::mousePressEvent(QMouseEvent *event)
           this->m_hasBreakPoint = true;
           emit breakPointSet(mouseEventPosition(event));
           this->m_updateBreakPointRequired = true;
+          this->requestDraw();
       }
       else
        {
@@ -109,6 +262,7 @@ void WaveformWidget::mousePressEvent(QMouseEvent *event)
           this->m_breakPointPos = 0;
           emit breakPointRemoved();
           this->m_updateBreakPointRequired = true;
+          this->requestDraw();
       }
   else if ((event->button() == Qt::LeftButton) && m_is_clickable)
       emit barClicked(event->x() > 5 ? mouseEventPosition(event) : 0);
@@ -120,7 +274,13 @@ void WaveformWidget::mousePressEvent(QMouseEvent *event)
 // Returns the position in milliseconds corresponding to the mouse position on the progress bar where the event occured
 int WaveformWidget::mouseEventPosition(const QMouseEvent *event) const
 {
-  return event->x() * (maximum() / width());
+  PeakRange range = this->visiblePeakRange();
+  int totalFrames = this->m_srcAudioFile->getTotalFrames();
+  if (range.endFrame <= range.startFrame || (range.startFrame == 0 && range.endFrame == totalFrames))
+      return event->x() * (maximum() / width());
+  /*zoomed in: the slider still spans the whole file*/
+  qreal frame = range.startFrame + (qreal) event->x() * (range.endFrame - range.startFrame) / width();
+  return (int) (frame / totalFrames * maximum());
 }
 
 void WaveformWidget::mouseMoveEvent(QMouseEvent *event)
@@ -148,54 +308,687 @@ void WaveformWidget::setClickable(bool clickable)
 /*!
 \brief Reset the audio file to be visualized by this instance of WaveformWidget.
 
-An important consideration when invoking this function is the file-handling mode that you
-have set for the current instance of WaveformWidget.  If the instance of WaveformWidget is in FULL_CACHE mode,
-this function will take considerably longer to execute (posssibly as long as a few seconds for an audio file of several
-minutes' duration) as the entirety of the audio file to be visualized
-by the widget must be loaded into memory.
-@param fileName Valid path to a WAV file
+The file is opened, probed and (in FULL_CACHE mode) loaded into memory on a worker thread, so this function
+returns immediately.  While the load is in progress, the widget draws a placeholder and emits loadProgress();
+once the file is ready it emits loaded() and draws the waveform, or emits loadFailed() if it could not be opened.
+Setting another file before the load has finished cancels it.  With deferred loading enabled (see setDeferredLoading()), the load only starts once the
+widget is on screen.
+@param fileName Valid path to an audio file
 */
 void WaveformWidget::resetFile(QFileInfo *fileName)
 {
     this->m_audioFilePath = fileName->canonicalFilePath();
-    this->m_srcAudioFile->setFile(m_audioFilePath);
+    this->m_peakFilePath.clear();
+    this->m_peakData.clear();
+    this->m_loadDevice = ANALYSIS_NO_DEVICE;
+    this->m_batchLoad = false;
+    this->requestLoad();
+ }
+
+/*!
+\brief Display a waveform from precomputed peak data instead of an audio file.
+
+The file is in one of the formats written by BBC audiowaveform (and by exportPeaks()): binary .dat, version 1
+or 2, or JSON.  No audio is decoded, so even very long files show up almost at once; the file is read on a
+worker thread like an audio file would be, and loaded() is emitted when it is ready (loadFailed() if it could
+not be read).  The waveform is drawn
+at the resolution of the peak file, and setFileHandlingMode() has no effect until an audio file is set again.
+@param peakFile Valid path to a .dat or .json peak file
+*/
+void WaveformWidget::setPeakSource(QFileInfo *peakFile)
+{
+    if (this->m_hasBreakPoint)
+        this->resetBreakPoint();
+    this->m_audioFilePath.clear();
+    this->m_peakFilePath = peakFile->canonicalFilePath();
+    this->m_peakData.clear();
+    this->m_loadDevice = ANALYSIS_NO_DEVICE;
+    this->m_batchLoad = false;
+    this->m_scaleFactor = -1.0;
+    this->m_lastSize = this->size();
+    this->m_padding = DEFAULT_PADDING;
+    this->requestLoad();
+}
+
+/*!
+\brief Like setPeakSource(), but for peak data already in memory, such as a peak file fetched over the network.
+@param peakData The contents of a .dat or .json peak file
+*/
+void WaveformWidget::setPeakData(const QByteArray &peakData)
+{
+    if (this->m_hasBreakPoint)
+        this->resetBreakPoint();
+    this->m_audioFilePath.clear();
+    this->m_peakFilePath.clear();
+    this->m_peakData = peakData;
+    this->m_loadDevice = ANALYSIS_NO_DEVICE;
+    this->m_batchLoad = false;
+    this->m_scaleFactor = -1.0;
+    this->m_lastSize = this->size();
+    this->m_padding = DEFAULT_PADDING;
+    this->requestLoad();
+}
 
-    switch(this->m_currentFileHandlingMode)
+/*!
+\brief Save the peaks of the current file for later use with setPeakSource().
+
+A path ending in ".json" gets audiowaveform's JSON format, anything else its binary .dat format.  See
+AudioUtil::exportPeaks().  Outside PEAKS_ONLY mode the peaks are computed from the file, which may take a while
+in DISK_MODE.
+@param filePath Path of the peak file to write
+@return true if the peak file was written, false otherwise (also while a load is in progress)
+*/
+bool WaveformWidget::exportPeaks(QString filePath)
+{
+    if (this->m_isLoading)
+        return false;
+    return this->m_srcAudioFile->exportPeaks(filePath);
+}
+
+/*!
+\brief Enable or disable deferred loading.
+
+When deferred loading is enabled, setSource(), resetFile(), setPeakSource() and setPeakData() only record
+the source while the widget is off screen -- not yet shown, hidden, or scrolled out of view.  Nothing is opened
+or analyzed until the widget comes into view, which keeps a long list of widgets cheap to build.  Once the
+widget has been off screen for getReleaseDelay() milliseconds, its file, cache and peaks are released again,
+and they are reloaded the next time it comes into view.  Disabled by default.
+@param deferred true to defer loading until the widget is visible
+*/
+void WaveformWidget::setDeferredLoading(bool deferred)
+{
+    this->m_deferredLoading = deferred;
+    if (!deferred)
+    {
+        this->m_releaseTimer->stop();
+        if (this->m_loadPending)
+            this->startLoad();
+    }
+    else
+    {
+        this->updateVisibility();
+    }
+}
+
+/*!
+\brief Whether deferred loading is enabled.  See setDeferredLoading().
+*/
+bool WaveformWidget::isDeferredLoading()
+{
+    return this->m_deferredLoading;
+}
+
+/*!
+\brief Set how long a widget with deferred loading must stay off screen before its file is released.
+@param msecs The delay in milliseconds (30 seconds by default)
+*/
+void WaveformWidget::setReleaseDelay(int msecs)
+{
+    this->m_releaseTimer->setInterval(std::max(0, msecs));
+}
+
+/*!
+\brief How long a widget with deferred loading stays off screen before its file is released, in milliseconds.
+*/
+int WaveformWidget::getReleaseDelay()
+{
+    return this->m_releaseTimer->interval();
+}
+
+/*!
+\brief Set how the widget's audio files are read.  See AudioUtil::setIOPolicy().
+
+The policy applies from the next load on, so set it before setSource() or resetFile().
+@param policy The I/O policy
+*/
+void WaveformWidget::setIOPolicy(const AudioUtil::IOPolicy &policy)
+{
+    this->m_ioPolicy = policy;
+}
+
+/*!
+\brief How the widget's audio files are read.  See setIOPolicy().
+*/
+AudioUtil::IOPolicy WaveformWidget::getIOPolicy()
+{
+    return this->m_ioPolicy;
+}
+
+/*!
+\brief Zoom the widget to a range of the file.
+
+The widget then draws frames startFrame to endFrame across its width, and value() and clicks are mapped onto that
+range, while the slider itself still spans the whole file.  An empty range shows the whole file again.
+
+Each range drawn is kept in a small cache of peak columns.  While the widget is on screen, the columns for the
+ranges either side of the one shown, and for the next zoom level in and out (half and twice the span, around the
+same center), are computed in the background at ANALYSIS_PRIORITY_PREFETCH, starting with the direction the view
+last moved in, so that panning and zooming step by step mostly finds its columns ready.  Changing direction drops
+the prefetches that have not finished.
+@param startFrame The first frame shown
+@param endFrame The frame after the last one shown
+*/
+void WaveformWidget::setVisibleRange(int startFrame, int endFrame)
+{
+    startFrame = std::max(0, startFrame);
+    if (endFrame <= startFrame)
+    {
+        startFrame = 0;
+        endFrame = 0;
+    }
+    if (startFrame == this->m_visibleStart && endFrame == this->m_visibleEnd)
+        return;
+
+    PeakRange previous = this->visiblePeakRange();
+    this->m_visibleStart = startFrame;
+    this->m_visibleEnd = endFrame;
+    PeakRange current = this->visiblePeakRange();
+
+    int previousSpan = previous.endFrame - previous.startFrame;
+    int currentSpan = current.endFrame - current.startFrame;
+    NavigationDirection direction = NO_DIRECTION;
+    if (currentSpan != previousSpan)
+        direction = currentSpan < previousSpan ? ZOOM_IN : ZOOM_OUT;
+    else if (current.startFrame != previous.startFrame)
+        direction = current.startFrame < previous.startFrame ? PAN_LEFT : PAN_RIGHT;
+
+    /*prefetches are only worth finishing while the view keeps moving the way it was*/
+    if (direction != this->m_navigationDirection)
+        this->cancelPrefetch();
+    this->m_navigationDirection = direction;
+    this->m_shouldRecalculatePeaks = true;
+    this->requestRedraw();
+}
+
+/*!
+\brief Show the whole file again.  See setVisibleRange().
+*/
+void WaveformWidget::resetVisibleRange()
+{
+    this->setVisibleRange(0, 0);
+}
+
+/*!
+\brief The first frame shown.  See setVisibleRange().
+*/
+int WaveformWidget::getVisibleStart()
+{
+    return this->visiblePeakRange().startFrame;
+}
+
+/*!
+\brief The frame after the last one shown.  See setVisibleRange().
+*/
+int WaveformWidget::getVisibleEnd()
+{
+    return this->visiblePeakRange().endFrame;
+}
+
+/*The range of the current file shown, clamped to its length, at the widget's width and render mode.*/
+WaveformWidget::PeakRange WaveformWidget::visiblePeakRange() const
+{
+    int totalFrames = this->m_srcAudioFile->getTotalFrames();
+    PeakRange range;
+    range.startFrame = std::min(this->m_visibleStart, totalFrames);
+    range.endFrame = std::min(this->m_visibleEnd, totalFrames);
+    if (range.endFrame <= range.startFrame)
+    {
+        range.startFrame = 0;
+        range.endFrame = totalFrames;
+    }
+    range.width = this->width();
+    range.renderMode = this->m_renderMode;
+    return range;
+}
+
+/*Takes the columns for range from the cache, if they are there, and moves them to its front.*/
+bool WaveformWidget::findCachedPeaks(const PeakRange &range)
+{
+    for (int i = 0; i < this->m_peakCache.size(); i++)
+    {
+        if (this->m_peakCache[i].range == range)
+        {
+            this->m_peakCache.move(i, 0);
+            const PeakColumns &columns = this->m_peakCache.first();
+            this->m_peakVector = columns.peaks;
+            this->m_bandVector = columns.bands;
+            this->m_scaleFactor = columns.scaleFactor;
+            this->m_redrawRequired = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*Adds columns to the front of the cache, dropping the least recently used entries beyond PEAK_CACHE_ENTRIES.*/
+void WaveformWidget::cachePeaks(const PeakColumns &columns)
+{
+    for (int i = 0; i < this->m_peakCache.size(); i++)
+    {
+        if (this->m_peakCache[i].range == columns.range)
+        {
+            this->m_peakCache.removeAt(i);
+            break;
+        }
+    }
+    this->m_peakCache.prepend(columns);
+    while (this->m_peakCache.size() > PEAK_CACHE_ENTRIES)
+        this->m_peakCache.removeLast();
+}
+
+/*Empties the cache, when the file it was computed from goes away.*/
+void WaveformWidget::clearPeakCache()
+{
+    this->cancelPrefetch();
+    this->m_peakCache.clear();
+}
+
+/*
+    Queues the computation of the columns around range that are neither cached nor already queued: the ranges
+    either side of it and the next zoom level in and out, the direction the view last moved in first.  Prefetch
+    jobs are submitted under &m_peakCache rather than this, so they can be dropped and reprioritized on their own.
+    Nothing is queued while releaseMemory() waits for the running ones to drain.
+*/
+void WaveformWidget::prefetchAround(const PeakRange &range)
+{
+    int totalFrames = this->m_srcAudioFile->getTotalFrames();
+    int span = range.endFrame - range.startFrame;
+    if (span <= 0 || this->m_isLive || this->m_releasePending || this->m_analysisPriority != ANALYSIS_PRIORITY_VISIBLE)
+        return;
+
+    int center = range.startFrame + span / 2;
+    PeakRange left = range, right = range, zoomIn = range, zoomOut = range;
+    left.startFrame = range.startFrame - span;
+    right.startFrame = range.endFrame;
+    zoomIn.startFrame = center - span / 4;
+    zoomOut.startFrame = center - span;
+    left.endFrame = left.startFrame + span;
+    right.endFrame = right.startFrame + span;
+    zoomIn.endFrame = zoomIn.startFrame + std::max(1, span / 2);
+    zoomOut.endFrame = zoomOut.startFrame + (int) std::min((qint64) totalFrames, 2 * (qint64) span);
+
+    PeakRange candidates[4];
+    switch (this->m_navigationDirection)
+    {
+        case PAN_LEFT:
+            candidates[0] = left; candidates[1] = right; candidates[2] = zoomIn; candidates[3] = zoomOut;
+            break;
+        case PAN_RIGHT:
+            candidates[0] = right; candidates[1] = left; candidates[2] = zoomIn; candidates[3] = zoomOut;
+            break;
+        case ZOOM_OUT:
+            candidates[0] = zoomOut; candidates[1] = zoomIn; candidates[2] = left; candidates[3] = right;
+            break;
+        default:
+            candidates[0] = zoomIn; candidates[1] = zoomOut; candidates[2] = left; candidates[3] = right;
+            break;
+    }
+
+    QSharedPointer<AudioUtil> audioFile = this->m_srcAudioFile;
+    int generation = this->m_loadGeneration;
+    int prefetchGeneration = this->m_prefetchGeneration;
+    for (int i = 0; i < 4 && this->m_prefetchPending.size() < PREFETCH_MAX_PENDING; i++)
+    {
+        /*ranges past either end of the file are slid back inside it*/
+        PeakRange candidate = candidates[i];
+        int length = candidate.endFrame - candidate.startFrame;
+        candidate.startFrame = std::max(0, std::min(candidate.startFrame, totalFrames - length));
+        candidate.endFrame = candidate.startFrame + length;
+
+        bool known = candidate == range || this->m_prefetchPending.contains(candidate);
+        for (int j = 0; j < this->m_peakCache.size() && !known; j++)
+            known = this->m_peakCache[j].range == candidate;
+        if (known)
+            continue;
+
+        this->m_prefetchPending.append(candidate);
+        AnalysisScheduler::instance()->submit(&this->m_peakCache, [this, audioFile, candidate, generation, prefetchGeneration]()
+        {
+            /*counted before the generation is checked: either releaseMemory() sees the job, or the job sees its bump*/
+            ++this->m_prefetchesRunning;
+            if (prefetchGeneration == this->m_prefetchGeneration)
+                this->recalculatePeaks(audioFile, candidate, generation, prefetchGeneration);
+            if (--this->m_prefetchesRunning == 0)
+                QMetaObject::invokeMethod(this, [this]()
+                {
+                    if (this->m_releasePending)
+                        this->releaseMemory();
+                }, Qt::QueuedConnection);
+        }, ANALYSIS_PRIORITY_PREFETCH);
+    }
+}
+
+/*
+    Drops the queued prefetches; running ones notice the new generation and stop at their next column.  A draw
+    waiting for one of them will not hear of it again, so it is queued anew.
+*/
+void WaveformWidget::cancelPrefetch()
+{
+    ++this->m_prefetchGeneration;
+    AnalysisScheduler::instance()->discard(&this->m_peakCache);
+    if (!this->m_prefetchPending.isEmpty())
+        this->requestDraw();
+    this->m_prefetchPending.clear();
+}
+
+/*The column the playback position falls on, which is off the widget while it is zoomed elsewhere.*/
+qreal WaveformWidget::progressColumn()
+{
+    qreal fraction = (qreal)value() / maximum();
+    PeakRange range = this->visiblePeakRange();
+    if (range.endFrame <= range.startFrame)
+        return fraction * width();
+    return (fraction * this->m_srcAudioFile->getTotalFrames() - range.startFrame) / (range.endFrame - range.startFrame) * width();
+}
+
+/*Whether a file or peak data has been set.*/
+bool WaveformWidget::hasSource()
+{
+    return !this->m_audioFilePath.isEmpty() || !this->m_peakFilePath.isEmpty() || !this->m_peakData.isEmpty();
+}
+
+/*Whether any part of the widget is currently on screen.*/
+bool WaveformWidget::isOnScreen()
+{
+    return this->isVisible() && !this->visibleRegion().isEmpty();
+}
+
+/*Loads the current source now, or with deferred loading while off screen, once the widget comes into view.*/
+void WaveformWidget::requestLoad()
+{
+    if (this->m_deferredLoading && !this->isOnScreen())
+        this->unloadSource();
+    else
+        this->startLoad();
+}
+
+/*
+    Drops the loaded file, along with any load or peak computation in flight, and draws the placeholder
+    until updateVisibility() loads it again.  The source itself is kept.
+*/
+void WaveformWidget::unloadSource()
+{
+    this->cancelLoad();
+    ++this->m_loadGeneration;
+    this->m_releaseTimer->stop();
+    this->m_srcAudioFile->setEvictionHandler(std::function<void()>());
+    this->m_srcAudioFile = QSharedPointer<AudioUtil>(new AudioUtil());
+    this->m_releasePending = false;
+    this->clearPeakCache();
+    vector<double>().swap(this->m_peakVector);
+    vector<double>().swap(this->m_bandVector);
+    vector<double>().swap(this->m_dataVector);
+    this->clearImages();
+    this->m_isLoading = false;
+    this->m_loadPending = true;
+    this->m_shouldRecalculatePeaks = true;
+    this->requestRedraw();
+}
+
+/*
+    With deferred loading, starts a pending load once the widget is on screen, and arms the release
+    timer while it is off screen.  Called on show and hide, and from overviewDraw(), which runs whenever
+    the widget or one of its ancestors moves (see eventFilter()), as when it is scrolled into or out of view.
+*/
+void WaveformWidget::updateVisibility()
+{
+    if (!this->m_deferredLoading || this->m_isLive)
+        return;
+
+    if (this->isOnScreen())
+    {
+        this->m_releaseTimer->stop();
+        if (this->m_loadPending)
+            this->startLoad();
+    }
+    else if (!this->m_loadPending && this->hasSource() && !this->m_releaseTimer->isActive())
+    {
+        this->m_releaseTimer->start();
+    }
+}
+
+/*Releases the file of a widget that has stayed off screen for the release delay.*/
+void WaveformWidget::releaseHidden()
+{
+    if (this->m_deferredLoading && !this->isOnScreen() && this->hasSource() && !this->m_isLive)
+        this->unloadSource();
+}
+
+/*!
+\brief Whether a file set with setSource() or resetFile() is still being loaded.
+@return true while the load is in progress, false otherwise.
+*/
+bool WaveformWidget::isLoading()
+{
+    return this->m_isLoading;
+}
+
+/*
+    Replaces the current file with an empty one, so a placeholder is drawn, and starts opening
+    m_audioFilePath (or importing m_peakFilePath or m_peakData) on a worker thread with a fresh AudioUtil instance.  Each load is tagged
+    with a generation number; results and progress from a superseded load are discarded.
+*/
+void WaveformWidget::startLoad()
+{
+    this->cancelLoad();
+    this->m_loadPending = false;
+
+    int generation = ++this->m_loadGeneration;
+    QString filePath = this->m_audioFilePath;
+    QString peakFilePath = this->m_peakFilePath;
+    QByteArray peakData = this->m_peakData;
+    QSharedPointer<AudioUtil> loader(new AudioUtil());
+    loader->setIOPolicy(this->m_ioPolicy);
+
+    loader->setProgressCallback([this, generation](int percent)
+    {
+        QMetaObject::invokeMethod(this, [this, generation, percent]()
+        {
+            if (generation == this->m_loadGeneration)
+                emit loadProgress(percent);
+        }, Qt::QueuedConnection);
+    });
+
+    /* the mode is set before the file, so setFile() does the whole load on the worker thread */
+    switch (this->m_currentFileHandlingMode)
     {
         case FULL_CACHE:
-            this->m_srcAudioFile->setFileHandlingMode(AudioUtil::FULL_CACHE);
+            loader->setFileHandlingMode(AudioUtil::FULL_CACHE);
+            break;
+
+        case AUTO:
+            loader->setFileHandlingMode(AudioUtil::AUTO);
+            break;
+
+        case PEAKS_ONLY:
+            loader->setFileHandlingMode(AudioUtil::PEAKS_ONLY);
+            break;
 
         case DISK_MODE:
-            this->m_srcAudioFile->setFileHandlingMode(AudioUtil::DISK_MODE);
+            break;
     }
 
+    this->m_activeLoader = loader;
+    this->m_srcAudioFile->setEvictionHandler(std::function<void()>());
+    this->m_srcAudioFile = QSharedPointer<AudioUtil>(new AudioUtil());
+    this->m_releasePending = false;
+    this->clearPeakCache();
     this->m_peakVector.clear();
+    this->m_bandVector.clear();
     this->m_dataVector.clear();
+    this->m_isLoading = true;
     this->m_shouldRecalculatePeaks = true;
-    this->repaint();
- }
+    this->requestRedraw();
+
+    this->m_analysisPriority = this->analysisPriority();
+    AnalysisScheduler::instance()->submit(this, [this, loader, filePath, peakFilePath, peakData, generation]()
+    {
+        bool succeeded;
+        if (!peakFilePath.isEmpty())
+            succeeded = loader->importPeaks(peakFilePath);
+        else if (!peakData.isEmpty())
+            succeeded = loader->importPeakData(peakData);
+        else
+            succeeded = loader->setFile(filePath);
+        if (succeeded)
+            loader->calculateNormalizedPeaks();
+        succeeded = succeeded && !loader->isCancelRequested();
+
+        QMetaObject::invokeMethod(this, [this, loader, succeeded, generation]()
+        {
+            this->finishLoad(loader, succeeded, generation);
+        }, Qt::QueuedConnection);
+    }, this->m_analysisPriority, this->m_loadDevice);
+}
+
+/*
+    The priority of this widget's jobs on the AnalysisScheduler: ANALYSIS_PRIORITY_VISIBLE while any of it
+    is on screen, lower the further it is from the visible part of its window (a widget scrolled out of a
+    scroll area is still inside the window's coordinate space, just beyond its edges), and lowest of all
+    while hidden.  A load started by setSources() stays at ANALYSIS_PRIORITY_BATCH until it comes on screen,
+    so that the batch keeps to its order on disk.
+*/
+int WaveformWidget::analysisPriority()
+{
+    if (this->isVisible() && !this->visibleRegion().isEmpty())
+        return ANALYSIS_PRIORITY_VISIBLE;
+    if (this->m_batchLoad && this->m_isLoading)
+        return ANALYSIS_PRIORITY_BATCH;
+    if (!this->isVisible())
+        return ANALYSIS_PRIORITY_HIDDEN;
+
+    QWidget *topLevel = this->window();
+    QRect viewport = topLevel->rect();
+    QRect area(this->mapTo(topLevel, QPoint(0, 0)), this->size());
+    int dx = std::max(0, std::max(viewport.left() - area.right(), area.left() - viewport.right()));
+    int dy = std::max(0, std::max(viewport.top() - area.bottom(), area.top() - viewport.bottom()));
+    return ANALYSIS_PRIORITY_VISIBLE - std::max(1, std::min(dx + dy, -ANALYSIS_PRIORITY_HIDDEN - 1));
+}
+
+/*Moves this widget's queued jobs to its current priority, if that has changed as it scrolled or was shown or hidden.*/
+void WaveformWidget::updateAnalysisPriority()
+{
+    int priority = this->analysisPriority();
+    if (priority == this->m_analysisPriority)
+        return;
+    this->m_analysisPriority = priority;
+    AnalysisScheduler::instance()->setPriority(this, priority);
+    /*nothing is prefetched for a widget that is not on screen*/
+    if (priority != ANALYSIS_PRIORITY_VISIBLE)
+        this->cancelPrefetch();
+}
+
+void WaveformWidget::showEvent(QShowEvent *event)
+{
+    QAbstractSlider::showEvent(event);
+    this->watchAncestors();
+    this->updateAnalysisPriority();
+    this->updateVisibility();
+    this->requestDraw();
+}
+
+void WaveformWidget::hideEvent(QHideEvent *event)
+{
+    QAbstractSlider::hideEvent(event);
+    this->updateAnalysisPriority();
+    this->updateVisibility();
+}
+
+/*
+    Runs on the GUI thread once a load started by startLoad() has finished, and swaps the loaded
+    file in unless a newer load has been started since.
+*/
+void WaveformWidget::finishLoad(QSharedPointer<AudioUtil> loader, bool succeeded, int generation)
+{
+    if (generation != this->m_loadGeneration)
+        return;
+
+    this->m_activeLoader.clear();
+    this->m_isLoading = false;
+    this->m_batchLoad = false;
+    if (succeeded)
+    {
+        this->m_srcAudioFile = loader;
+        /*under memory pressure the AudioUtil may ask, from any thread, for its cache to be dropped*/
+        loader->setEvictionHandler([this]()
+        {
+            QMetaObject::invokeMethod(this, [this]() { this->releaseMemory(); }, Qt::QueuedConnection);
+        });
+    }
+    this->m_shouldRecalculatePeaks = true;
+    this->requestRedraw();
+    if (succeeded)
+        emit loaded();
+    else
+        emit loadFailed();
+}
+
+/*Cancels the load in progress, if any.  Its results will be ignored when it finishes.*/
+void WaveformWidget::cancelLoad()
+{
+    if (!this->m_activeLoader.isNull())
+    {
+        this->m_activeLoader->requestCancel();
+        this->m_activeLoader.clear();
+    }
+}
+
+/*
+    Drops the sample cache of the current file, once no peak computation is using it.  Prefetches query the same
+    AudioUtil: the queued ones are dropped and the running ones stop at their next column, and the cache is
+    released when the view's computation or the last of them finishes, rather than waiting for them here.
+*/
+void WaveformWidget::releaseMemory()
+{
+    this->cancelPrefetch();
+    if (this->m_isRecalculatingPeaks || this->m_prefetchesRunning > 0)
+    {
+        this->m_releasePending = true;
+        return;
+    }
+    this->m_releasePending = false;
+    this->m_srcAudioFile->setFileHandlingMode(AudioUtil::DISK_MODE);
+}
 
 /*!
   \brief Mutator for the file-handling mode of a given instance of WaveformWidget.
 
 An instance of WaveformWidget relies on an AudioUtil object to do much of the analysis of the audio file
-that it visualizes.  This AudioUtil object can function in one of two modes: DISK_MODE or FULL_CACHE.
-For a comprehensive outline of the benefits and drawbacks of each mode, see the documentation for
-AudioUtil::setFileHandlingMode(FileHandlingMode mode).
+that it visualizes.  This AudioUtil object can function in DISK_MODE, FULL_CACHE, PEAKS_ONLY (which keeps only
+quantized block peaks, enough for an overview) or AUTO, the default, which picks FULL_CACHE or DISK_MODE from the
+size of the file and the memory budget left (see AudioUtil::setMemoryBudget()).  For a comprehensive outline of the benefits and drawbacks of each mode, see the
+documentation for AudioUtil::setFileHandlingMode(FileHandlingMode mode).
+
+If a file is already set, switching to DISK_MODE releases its cache, and switching to another mode reloads it
+in the background.
 
-@param mode The desired file-handling mode.  Valid options: WaveformWidget::FULL_CACHE, WaveformWidget::DISK_MODE
+@param mode The desired file-handling mode.  Valid options: WaveformWidget::FULL_CACHE, WaveformWidget::DISK_MODE,
+WaveformWidget::AUTO, WaveformWidget::PEAKS_ONLY
 */
 void WaveformWidget::setFileHandlingMode(FileHandlingMode mode)
 {
     this->m_currentFileHandlingMode = mode;
+    if (this->m_audioFilePath.isEmpty())
+        return;
+
+    /*a deferred load picks the new mode up when it starts*/
+    if (this->m_loadPending)
+        return;
 
     switch (this->m_currentFileHandlingMode)
     {
-        case FULL_CACHE:
-            this->m_srcAudioFile->setFileHandlingMode(AudioUtil::FULL_CACHE);
-
         case DISK_MODE:
-            this->m_srcAudioFile->setFileHandlingMode(AudioUtil::DISK_MODE);
+            if (this->m_isLoading)
+                this->requestLoad();
+            else
+                this->releaseMemory();
+            break;
+
+        case FULL_CACHE:
+        case AUTO:
+        case PEAKS_ONLY:
+            this->requestLoad();
+            break;
     }
 }
 
@@ -209,178 +1002,670 @@ WaveformWidget::FileHandlingMode WaveformWidget::getFileHandlingMode()
     return this->m_currentFileHandlingMode;
 }
 
-void WaveformWidget::recalculatePeaks()
+/*
+    Runs on a worker thread.  Computes the peak of every region of the given range to be represented
+    by a single pixel, and hands the result back to the GUI thread through publishPeaks().  The
+    audio file is passed in as a shared pointer so that it stays alive even if a new file is set
+    while the computation is running.  A prefetch (prefetchGeneration >= 0) gives up, publishing
+    nothing, as soon as cancelPrefetch() has been called since it was queued.
+*/
+void WaveformWidget::recalculatePeaks(QSharedPointer<AudioUtil> audioFile, PeakRange range, int generation, int prefetchGeneration)
 {
-    if (this->m_srcAudioFile->getSndFIleNotEmpty() && !this->m_isRecalculatingPeaks)
+    PeakColumns columns;
+    columns.range = range;
+    columns.scaleFactor = -1.0;
+
+    if (audioFile->getSndFIleNotEmpty() && range.width > 0 && range.endFrame > range.startFrame)
     {
-        this->m_isRecalculatingPeaks = true;
         /*calculate scale factor*/
-        vector<double> normPeak = m_srcAudioFile->calculateNormalizedPeaks();
-        double peak = MathUtil::getVMax(normPeak);
-        this->m_scaleFactor = 1.0/peak;
-        this->m_scaleFactor = m_scaleFactor - m_scaleFactor * this->m_padding;
+        vector<double> normPeak = audioFile->calculateNormalizedPeaks();
+        if (!normPeak.empty())
+        {
+            double peak = MathUtil::getVMax(normPeak);
+            columns.scaleFactor = 1.0/peak;
+            columns.scaleFactor = columns.scaleFactor - columns.scaleFactor * this->m_padding;
+        }
 
         /*calculate frame-grab increments*/
-        int totalFrames = m_srcAudioFile->getTotalFrames();
-        int frameIncrement = totalFrames/this->width();
-            if(m_srcAudioFile->getNumChannels() == 2)
-            {
-                this->m_peakVector.clear();
-
-                vector<double> regionMax;
+        int totalFrames = audioFile->getTotalFrames();
+        int frameIncrement = std::max(1, (range.endFrame - range.startFrame)/range.width);
+            int numChannels = audioFile->getNumChannels();
+            vector<double> regionMax;
 
-                /*
-                  Populate the m_peakVector.at with peak values for each region of the source audio
-                  file to be represented by a single pixel of the widget.
-                */
+            /*
+              Populate the peak vector with peak values for each region of the source audio
+              file to be represented by a single pixel of the widget, one per channel.
+            */
 
-                for(int i = 0; i < totalFrames; i += frameIncrement)
-                {
-                    regionMax = m_srcAudioFile->peakForRegion(i, i+frameIncrement);
-                    if (regionMax.size() == 2)
-                    {
-                        double frameAbsL = fabs(regionMax[0]);
-                        double frameAbsR = fabs(regionMax[1]);
-                        this->m_peakVector.push_back(frameAbsL);
-                        this->m_peakVector.push_back(frameAbsR);
-                    }
-                    else
-                    {
-                        double frameAbsL = fabs(0.0);
-                        double frameAbsR = fabs(0.0);
-                        this->m_peakVector.push_back(frameAbsL);
-                        this->m_peakVector.push_back(frameAbsR);
-
-                    }
-                }
+            for(int i = range.startFrame; i < range.endFrame; i += frameIncrement)
+            {
+                if (prefetchGeneration >= 0 && prefetchGeneration != this->m_prefetchGeneration)
+                    return;
+                regionMax = audioFile->peakForRegion(i, std::min(i+frameIncrement, range.endFrame));
+                for (int c = 0; c < numChannels; c++)
+                    columns.peaks.push_back((int) regionMax.size() == numChannels ? fabs(regionMax[c]) : 0.0);
             }
 
-            if(this->m_srcAudioFile->getNumChannels() == 1)
+            /*
+              One band-energy triple per drawn column, so it lines up with the peaks.  The bands are
+              computed for columns of the same size across the whole file and the shown ones picked
+              out, which is only affordable up to SPECTRAL_MAX_FILE_COLUMNS; a view zoomed in further
+              is drawn in the plain colors.
+            */
+            int fileColumns = (totalFrames + frameIncrement - 1) / frameIncrement;
+            if (range.renderMode == SPECTRAL_MODE && fileColumns <= SPECTRAL_MAX_FILE_COLUMNS)
             {
+                if (prefetchGeneration >= 0 && prefetchGeneration != this->m_prefetchGeneration)
+                    return;
+                vector<double> fileBands = audioFile->bandEnergiesForColumns(fileColumns);
+                size_t first = 3 * (size_t) (range.startFrame / frameIncrement);
+                size_t last = std::min(fileBands.size(), first + 3 * columns.peaks.size() / std::max(1, numChannels));
+                if (first < last)
+                    columns.bands.assign(fileBands.begin() + first, fileBands.begin() + last);
+            }
+    }
 
-                this->m_peakVector.clear();
-                vector<double> regionMax;
-
-                /*
-                  Populate the m_peakVector.at with peak values for each region of the source audio
-                  file to be represented by a single pixel of the widget.
-                */
+    QMetaObject::invokeMethod(this, [this, columns, generation, prefetchGeneration]()
+    {
+        this->publishPeaks(columns, generation, prefetchGeneration);
+    }, Qt::QueuedConnection);
+}
 
-                for(int i = 0; i < totalFrames; i += frameIncrement)
-                {
-                    regionMax = m_srcAudioFile->peakForRegion(i, i+frameIncrement);
-                    double frameAbs = fabs(regionMax[0]);
+/*
+    Runs on the GUI thread; caches columns computed by recalculatePeaks() unless they belong to a file that
+    has since been replaced.  Columns computed for the view are also shown, and the prefetching around them
+    started; prefetched columns are picked up from the cache by overviewDraw() once the view reaches them.
+*/
+void WaveformWidget::publishPeaks(PeakColumns columns, int generation, int prefetchGeneration)
+{
+    if (prefetchGeneration < 0)
+        this->m_isRecalculatingPeaks = false;
+    else
+        this->m_prefetchPending.removeOne(columns.range);
+    if (generation != this->m_loadGeneration)
+    {
+        /*a draw for the current file may have given up while this job held the flag*/
+        if (prefetchGeneration < 0)
+            this->requestDraw();
+        return;
+    }
 
-                    this->m_peakVector.push_back(frameAbs);
-                }
-            }
+    this->cachePeaks(columns);
+    if (prefetchGeneration < 0)
+    {
+        this->m_peakVector = columns.peaks;
+        this->m_bandVector = columns.bands;
+        this->m_scaleFactor = columns.scaleFactor;
+        this->requestRedraw();
+        if (this->m_releasePending)
+            this->releaseMemory();
+        else if (!this->m_shouldRecalculatePeaks)
+            this->prefetchAround(columns.range);
     }
-    this->m_isRecalculatingPeaks = false;
-    this->m_shouldRecalculatePeaks = false;
+    else if (this->m_shouldRecalculatePeaks)
+    {
+        /*the view may have been waiting for this one*/
+        this->requestDraw();
+    }
+}
+
+/*!
+\brief Mutator for the render mode of a given instance of WaveformWidget.
+
+In PEAK_MODE (the default), the waveform is drawn in the waveform and progress colors.  In SPECTRAL_MODE,
+each column is colored by the spectral balance of the audio it represents: red for energy in the low band, green
+for the mid band and blue for the high band (see AudioUtil::bandEnergiesForColumns()).  The spectral analysis runs
+on the same worker thread as the peak analysis, and is cached by the AudioUtil instance.
+
+@param mode The desired render mode.  Valid options: WaveformWidget::PEAK_MODE, WaveformWidget::SPECTRAL_MODE
+*/
+void WaveformWidget::setRenderMode(RenderMode mode)
+{
+    if (mode == this->m_renderMode)
+        return;
+    this->m_renderMode = mode;
+    this->m_shouldRecalculatePeaks = true;
+    this->requestRedraw();
+}
+
+/*!
+\brief Accessor for the render mode of a given instance of WaveformWidget.
+
+@return The render mode of a given instance of WaveformWidget.
+*/
+WaveformWidget::RenderMode WaveformWidget::getRenderMode()
+{
+    return this->m_renderMode;
+}
+
+/*The color a column is drawn in: the waveform or progress color, or in SPECTRAL_MODE its band balance (dimmed once played).*/
+QColor WaveformWidget::columnColor(const RenderState &state, int column, bool played)
+{
+    if (!state.spectral || 3*column+2 >= (int) state.bands.size())
+        return played ? state.progressColor : state.waveformColor;
+
+    double low = state.bands[3*column];
+    double mid = state.bands[3*column+1];
+    double high = state.bands[3*column+2];
+    double strongest = std::max(low, std::max(mid, high));
+    if (strongest <= 0.0)
+        return played ? state.progressColor : state.waveformColor;
+
+    QColor color = QColor::fromRgbF(low/strongest, mid/strongest, high/strongest);
+    return played ? color.darker(170) : color;
 }
 
 /*
-    The overview drawing function works with the m_peakVector.at, which contains the peak value
-    for every region (and each channel) of the source audio file to be represented by a single
-    pixel of the widget.  The function steps through this vector and draws two vertical bars
-    for each such value -- one above the Y-axis midpoint for the channel, and one below.
+    Runs whenever something shown may have changed: through requestDraw(), on frame clock ticks that move the
+    cursor to another column, and as each redraw lands.  Once the columns for the current view are at hand and
+    something has changed since the last redraw, a snapshot of what is to be drawn is handed to the render pool, which
+    rasterizes it into the back buffer with rasterize(); publishImage() then swaps it to the front.  At most
+    one redraw per widget is in flight, and changes made meanwhile are picked up as soon as it lands.
 */
 void WaveformWidget::overviewDraw()
 {
-    if (((qreal)value() / maximum() * width() == m_lastDrawnValue && !m_updateBreakPointRequired) || this->m_isRecalculatingPeaks || this->m_audioFilePath.isEmpty())
+    if (this->isVisible() && !this->visibleRegion().isEmpty())
+        this->m_srcAudioFile->markViewed();
+    this->updateAnalysisPriority();
+    this->updateVisibility();
+
+    qreal progress = this->progressColumn();
+    /*a cursor off screen is not worth a redraw; the widget is drawn again as it comes into view*/
+    bool cursorMoved = qCeil(progress) != m_lastDrawnColumn && this->isOnScreen();
+    if ((!cursorMoved && !m_updateBreakPointRequired && !m_redrawRequired) || this->m_isRecalculatingPeaks || this->m_isRendering || (!this->hasSource() && !this->m_isLive))
          return;
-    if (this->m_shouldRecalculatePeaks)
+    if (this->m_shouldRecalculatePeaks && !this->m_isLoading && !this->m_loadPending && !this->m_isLive)
     {
-        QtConcurrent::run(this, &WaveformWidget::recalculatePeaks); //this->recalculatePeaks();
-        return;
+        PeakRange range = this->visiblePeakRange();
+        if (!this->findCachedPeaks(range))
+        {
+            if (this->m_prefetchPending.contains(range))
+            {
+                /*already on its way as a prefetch: wait for it, moved up to the widget's own priority*/
+                AnalysisScheduler::instance()->setPriority(&this->m_peakCache, this->m_analysisPriority);
+                return;
+            }
+            this->m_shouldRecalculatePeaks = false;
+            this->m_isRecalculatingPeaks = true;
+            QSharedPointer<AudioUtil> audioFile = this->m_srcAudioFile;
+            int generation = this->m_loadGeneration;
+            AnalysisScheduler::instance()->submit(this, [this, audioFile, range, generation]()
+            {
+                this->recalculatePeaks(audioFile, range, generation, -1);
+            }, this->m_analysisPriority);
+            return;
+        }
+        this->m_shouldRecalculatePeaks = false;
+        this->prefetchAround(range);
     }
 
-    m_pixMap = QPixmap(this->m_lastSize);
-    m_pixMap.scaled(m_lastSize);
-    m_pixMap.fill(this->m_waveformBackgroundColor);
-    QPainter painter(&m_pixMap);
+    /*the back buffer is handed over whole, so the render thread holds the only reference and draws in place*/
+    RenderState state = this->renderState(progress);
+    QSharedPointer<QImage> image(new QImage());
+    image->swap(this->m_backImage);
+    int generation = this->m_renderGeneration;
+    this->m_isRendering = true;
+    AnalysisScheduler::instance()->submitRender(&this->m_frontImage, [this, state, image, generation]()
+    {
+        rasterize(state, *image);
+        QMetaObject::invokeMethod(this, [this, image, generation]()
+        {
+            this->publishImage(*image, generation);
+        }, Qt::QueuedConnection);
+    });
+
+    size_t columnBytes = (m_peakVector.capacity() + m_bandVector.capacity()) * sizeof(double);
+    for (int i = 0; i < m_peakCache.size(); i++)
+        columnBytes += (m_peakCache[i].peaks.capacity() + m_peakCache[i].bands.capacity()) * sizeof(double);
+    size_t imageBytes = 2 * (size_t) state.size.width() * state.size.height() * 4;
+    this->m_srcAudioFile->setExternalMemoryUsage(imageBytes + columnBytes);
+    m_lastDrawnColumn = qCeil(progress);
+    this->m_lastSize = this->size();
+    this->m_redrawRequired = false;
+    this->m_updateBreakPointRequired = false;
+
+}
 
-    int minX = this->m_pixMap.rect().x();
-    int maxX = this->m_pixMap.rect().x() + this->m_pixMap.rect().width();
+/*Copies what the next redraw needs out of the widget, so the render thread never reads widget state.*/
+WaveformWidget::RenderState WaveformWidget::renderState(qreal progress)
+{
+    RenderState state;
+    state.size = this->m_lastSize;
+    state.progress = progress;
+    state.live = this->m_isLive;
+    state.placeholder = this->m_isLoading || this->m_loadPending;
+    state.hasFile = this->m_srcAudioFile->getSndFIleNotEmpty();
+    state.numChannels = std::max(1, this->m_srcAudioFile->getNumChannels());
+    state.scaleFactor = this->m_scaleFactor;
+    state.spectral = this->m_renderMode == SPECTRAL_MODE;
+    state.waveformColor = this->m_waveformColor;
+    state.progressColor = this->m_progressColor;
+    state.backgroundColor = this->m_waveformBackgroundColor;
+    state.breakPointPos = this->m_hasBreakPoint ? this->m_breakPointPos : 0;
+    state.liveColumnHead = this->m_liveColumnHead;
+    state.liveColumnCount = this->m_liveColumnCount;
+    state.liveChannels = this->m_liveChannels;
+    state.padding = this->m_padding;
+    if (state.live)
+        state.liveColumns = this->m_liveColumns;
+    else if (!state.placeholder && state.hasFile)
+    {
+        state.peaks = this->m_peakVector;
+        if (state.spectral)
+            state.bands = this->m_bandVector;
+    }
+    return state;
+}
+
+/*
+    Runs on a render thread.  The overview drawing function works with the peaks of the state, which
+    holds the peak value for every region (and each channel) of the source audio file to be represented
+    by a single pixel of the widget.  The function steps through them and draws two vertical bars for
+    each such value -- one above the Y-axis midpoint for the channel, and one below.  image is reused
+    when it already has the right size.
+*/
+void WaveformWidget::rasterize(const RenderState &state, QImage &image)
+{
+    if (image.size() != state.size || image.format() != QImage::Format_ARGB32_Premultiplied)
+        image = QImage(state.size, QImage::Format_ARGB32_Premultiplied);
+    if (image.isNull())
+        return;
+    image.fill(state.backgroundColor);
+    QPainter painter(&image);
+
+    int height = state.size.height();
+    int minX = 0;
+    int maxX = state.size.width();
 
-    int startIndex = 2*minX;
     int endIndex = 2*maxX;
 
-    int yMidpoint = this->height()/2;
-    int counter = minX;
+    int yMidpoint = height/2;
 
-    if (this->m_srcAudioFile->getSndFIleNotEmpty())
+    if (state.live)
     {
-        /*grab peak values for each region to be represented by a pixel in the visible
-        portion of the widget, scale them, and draw: */
-        if(this->m_srcAudioFile->getNumChannels() == 2)
-        {
-                for(int i = startIndex;  i < endIndex; i+=2)
-                {
-                    if (counter < (qreal)value() / maximum() * width())
-                        painter.setPen(QPen(this->m_progressColor, 1, Qt::SolidLine, Qt::RoundCap));
-                    else
-                        painter.setPen(QPen(this->m_waveformColor, 1, Qt::SolidLine, Qt::RoundCap));
+        drawLiveColumns(state, painter);
+    }
 
-                    int chan1YMidpoint = yMidpoint - this->height()/4;
-                    int chan2YMidpoint = yMidpoint + this->height()/4;
+    else if (state.placeholder)
+    {
+        /*placeholder while the file is loading: a flat line across the midpoint*/
+        painter.setPen(QPen(state.waveformColor, 1, Qt::DotLine, Qt::RoundCap));
+        painter.drawLine(minX, yMidpoint, maxX, yMidpoint);
+    }
 
+    else if (state.hasFile)
+    {
+        /*grab peak values for each region to be represented by a pixel in the visible
+        portion of the widget, scale them, and draw them in one lane per channel, stacked
+        top to bottom: */
+        int numChannels = state.numChannels;
+        int amplitude = height / (2 * std::max(2, numChannels));
 
-                    painter.drawLine(counter, chan1YMidpoint, counter, chan1YMidpoint+((this->height()/4)*this->m_peakVector.at(i)*m_scaleFactor));
-                    painter.drawLine(counter, chan1YMidpoint, counter, chan1YMidpoint -((this->height()/4)*this->m_peakVector.at(i)*m_scaleFactor));
+        for(int column = minX; column < maxX && (column + 1) * numChannels <= (int) state.peaks.size(); column++)
+        {
+            painter.setPen(QPen(columnColor(state, column, column < state.progress), 1, Qt::SolidLine, Qt::RoundCap));
 
-                    painter.drawLine(counter, chan2YMidpoint, counter, chan2YMidpoint+((this->height()/4)*this->m_peakVector.at(i+1)*m_scaleFactor)   );
-                    painter.drawLine(counter, chan2YMidpoint, counter, chan2YMidpoint -((this->height()/4)*this->m_peakVector.at(i+1)*m_scaleFactor)   );
-                    counter++;
-                }
-        }
+            for (int c = 0; c < numChannels; c++)
+            {
+                int laneYMidpoint = yMidpoint + (2*c + 1 - numChannels) * height / (2 * numChannels);
+                double peak = state.peaks.at(column * numChannels + c);
 
-        if(m_srcAudioFile->getNumChannels() == 1)
-        {
-               int curIndex = minX;
-               int yMidpoint = this->height()/2;
-
-               for(unsigned int i = 0; i < m_peakVector.size(); i++)
-               {
-                   if (curIndex < (qreal)value() / maximum() * width())
-                       painter.setPen(QPen(this->m_progressColor, 1, Qt::SolidLine, Qt::RoundCap));
-                   else
-                       painter.setPen(QPen(this->m_waveformColor, 1, Qt::SolidLine, Qt::RoundCap));
-                   painter.drawLine(curIndex, yMidpoint, curIndex, yMidpoint+((this->height()/4)*this->m_peakVector.at(i)*m_scaleFactor)   );
-                   painter.drawLine(curIndex, yMidpoint, curIndex, yMidpoint -((this->height()/4)*this->m_peakVector.at(i)*m_scaleFactor)   );
-
-                   curIndex++;
-               }
+                painter.drawLine(column, laneYMidpoint, column, laneYMidpoint + (amplitude * peak * state.scaleFactor));
+                painter.drawLine(column, laneYMidpoint, column, laneYMidpoint - (amplitude * peak * state.scaleFactor));
+            }
         }
     }
 
     else
     {
         int curIndex = minX;
-        int yMidpoint = this->height()/2;
         for(int i = 0; i < endIndex; i++)
         {
-            if (curIndex < (qreal)value() / maximum() * width())
-                painter.setPen(QPen(this->m_progressColor, 1, Qt::SolidLine, Qt::RoundCap));
+            if (curIndex < state.progress)
+                painter.setPen(QPen(state.progressColor, 1, Qt::SolidLine, Qt::RoundCap));
             else
-                painter.setPen(QPen(this->m_waveformColor, 1, Qt::SolidLine, Qt::RoundCap));
-            painter.drawLine(curIndex, yMidpoint, curIndex, yMidpoint+(this->height()));
-            painter.drawLine(curIndex, yMidpoint, curIndex, yMidpoint-(this->height()));
+                painter.setPen(QPen(state.waveformColor, 1, Qt::SolidLine, Qt::RoundCap));
+            painter.drawLine(curIndex, yMidpoint, curIndex, yMidpoint+height);
+            painter.drawLine(curIndex, yMidpoint, curIndex, yMidpoint-height);
 
             curIndex++;
         }
     }
-    if (this->m_breakPointPos > 0 && this->m_hasBreakPoint)
+    if (state.breakPointPos > 0)
     {
         painter.setPen(QPen(Qt::darkGray, 2, Qt::SolidLine, Qt::RoundCap));
-        painter.drawLine(m_breakPointPos, 0, m_breakPointPos, 1000);
+        painter.drawLine(state.breakPointPos, 0, state.breakPointPos, 1000);
     }
+}
 
-    this->m_pixMapLabel->setPixmap(m_pixMap);
-    this->m_pixMapLabel->resize(this->m_lastSize);
-    m_lastDrawnValue = (qreal)value() / maximum() * width();
-    this->m_lastSize = this->size();
+/*
+    Runs on the GUI thread once rasterize() has finished: the new image becomes the front buffer and the
+    old front one the back buffer for the next redraw.  Images drawn before clearImages() are dropped.
+*/
+void WaveformWidget::publishImage(QImage image, int generation)
+{
+    this->m_isRendering = false;
+    if (generation == this->m_renderGeneration)
+    {
+        this->m_backImage = this->m_frontImage;
+        this->m_frontImage = image;
+        this->update();
+    }
+    /*catch up with whatever changed while the image was being drawn, the cursor included*/
+    this->overviewDraw();
+}
+
+/*Drops both buffers, and any image still being drawn, so nothing of the previous file is shown.*/
+void WaveformWidget::clearImages()
+{
+    ++this->m_renderGeneration;
+    this->m_frontImage = QImage();
+    this->m_backImage = QImage();
+    this->update();
+}
+
+/*Only blits the front buffer; the waveform itself is drawn on a render thread.*/
+void WaveformWidget::paintEvent(QPaintEvent *event)
+{
+    this->m_srcAudioFile->markViewed();
+    QPainter painter(this);
+    painter.drawImage(event->rect(), this->m_frontImage, event->rect());
+}
+
+/*Queues one call to overviewDraw(), however many times this is called before it runs.*/
+void WaveformWidget::requestDraw()
+{
+    if (this->m_drawQueued)
+        return;
+    this->m_drawQueued = true;
+    QMetaObject::invokeMethod(this, [this]()
+    {
+        this->m_drawQueued = false;
+        this->overviewDraw();
+    }, Qt::QueuedConnection);
+}
+
+/*Marks the image out of date and queues its redraw.*/
+void WaveformWidget::requestRedraw()
+{
+    this->m_redrawRequired = true;
+    this->requestDraw();
+}
+
+/*
+    Subscribes to the frame clock while the value is changing, and redraws for a new range.  The base class
+    would repaint the widget on every change; the frame clock redraws it only when the cursor changes column.
+*/
+void WaveformWidget::sliderChange(SliderChange change)
+{
+    if (change == SliderValueChange)
+    {
+        this->m_idleFrames = 0;
+        if (this->isOnScreen() && !FrameClock::instance()->isSubscribed(this))
+            FrameClock::instance()->subscribe(this, [this]() { this->frameTick(); });
+    }
+    else
+    {
+        this->requestDraw();
+    }
+}
+
+/*
+    Runs on each tick of the frame clock while subscribed: redraws once the cursor has moved to another column,
+    and unsubscribes once value() has stayed put for FRAME_CLOCK_IDLE_FRAMES ticks or the widget is off screen.
+*/
+void WaveformWidget::frameTick()
+{
+    if (++this->m_idleFrames >= FRAME_CLOCK_IDLE_FRAMES || !this->isOnScreen())
+        FrameClock::instance()->unsubscribe(this);
+    if (qCeil(this->progressColumn()) != this->m_lastDrawnColumn)
+        this->overviewDraw();
+}
+
+/*
+    Notices the widget being taken on or off screen by its ancestors: a scroll area moves the widget holding
+    its contents, for one, rather than the widgets inside it.
+*/
+bool WaveformWidget::eventFilter(QObject *watched, QEvent *event)
+{
+    switch (event->type())
+    {
+        case QEvent::Move:
+        case QEvent::Resize:
+        case QEvent::Show:
+        case QEvent::Hide:
+            this->requestDraw();
+            break;
+        default:
+            break;
+    }
+    return QAbstractSlider::eventFilter(watched, event);
+}
+
+/*Watches the widget and each of its ancestors, which may have changed since it was last shown.*/
+void WaveformWidget::watchAncestors()
+{
+    for (int i = 0; i < this->m_watchedWidgets.size(); i++)
+    {
+        if (!this->m_watchedWidgets[i].isNull())
+            this->m_watchedWidgets[i]->removeEventFilter(this);
+    }
+    this->m_watchedWidgets.clear();
+    for (QWidget *widget = this; widget != nullptr; widget = widget->parentWidget())
+    {
+        widget->installEventFilter(this);
+        this->m_watchedWidgets.append(widget);
+    }
+}
+
+/*!
+\brief Switches the widget to displaying live input pushed with pushLiveFrames().
+
+The ring buffer between the audio thread and the widget is allocated here, from the GUI thread; frames pushed
+before it are dropped without being counted.  The widget drains the buffer on its own timer and scrolls the most
+recent windowSeconds of audio across its width, one peak column per pixel.  Calling it again restarts live display
+with the new format, which the audio thread may keep pushing frames through: each push uses either the old buffer
+and channel count or the new ones, never a mix.
+
+@param channels Number of interleaved channels in the pushed frames
+@param sampleRate Sample rate of the pushed frames
+@param windowSeconds Duration of audio shown across the width of the widget
+@param bufferFrames Number of frames the ring buffer can hold between two drains
+*/
+void WaveformWidget::startLiveInput(int channels, int sampleRate, double windowSeconds, int bufferFrames)
+{
+    this->stopLiveInput();
+
+    this->m_liveChannels = std::max(1, channels);
+    this->m_liveSampleRate = std::max(1, sampleRate);
+    this->m_liveWindowSeconds = windowSeconds;
+    this->m_liveScratch.assign(LIVE_SCRATCH_FRAMES * this->m_liveChannels, 0.0f);
+    this->m_liveColumnCount = 0;
+    this->m_liveOverrunFrames = 0;
+    this->m_liveOverrunEvents = 0;
+    this->publishLiveInput(new LiveInput(bufferFrames * this->m_liveChannels, this->m_liveChannels));
+    this->m_isLive = true;
+    this->requestRedraw();
+    this->m_liveTimer->start();
+}
+
+/*!
+\brief Leaves live display.
+
+The audio thread may still be pushing frames; they are dropped from its next push on.  The ring buffer is freed once
+that push has acknowledged the switch, or when the widget is destroyed if the audio thread has stopped pushing.
+*/
+void WaveformWidget::stopLiveInput()
+{
+    this->m_liveTimer->stop();
+    this->m_isLive = false;
+    this->publishLiveInput(NULL);
+    this->m_liveColumns.clear();
+    this->requestRedraw();
+}
+
+/*
+    Replaces the input pushLiveFrames() writes to.  A push may already have loaded the old one, so it is only
+    retired, to be freed once a later push has acknowledged the new publication count.
+*/
+void WaveformWidget::publishLiveInput(LiveInput *input)
+{
+    LiveInput *previous = this->m_liveInput.exchange(input);
+    quint64 published = ++this->m_livePublished;
+    if (previous != NULL)
+        this->m_liveRetired.push_back(std::make_pair(published, previous));
+    this->freeRetiredLiveInputs();
+}
+
+/*Frees the retired inputs whose replacement the audio thread has acknowledged; no push can still be writing to them.*/
+void WaveformWidget::freeRetiredLiveInputs()
+{
+    quint64 acknowledged = this->m_liveAcknowledged.load();
+    size_t kept = 0;
+    for (size_t i = 0; i < this->m_liveRetired.size(); i++)
+    {
+        if (this->m_liveRetired[i].first <= acknowledged)
+            delete this->m_liveRetired[i].second;
+        else
+            this->m_liveRetired[kept++] = this->m_liveRetired[i];
+    }
+    this->m_liveRetired.resize(kept);
+}
+
+/*!
+\brief Whether the widget is displaying live input.
+@return true between startLiveInput() and stopLiveInput(), false otherwise.
+*/
+bool WaveformWidget::isLive()
+{
+    return this->m_isLive;
+}
+
+/*!
+\brief Hands interleaved frames from the audio thread to the widget.
+
+This is the only function that may be called from the real-time audio thread, and it is wait-free: it never locks,
+allocates or blocks.  Frames that do not fit in the ring buffer are dropped whole and counted as an overrun.  It may
+run concurrently with startLiveInput() and stopLiveInput(), but not with another pushLiveFrames().
+
+@param frames frameCount frames of interleaved samples, in the channel count passed to startLiveInput()
+@param frameCount Number of frames to push
+@return The number of frames accepted.
+*/
+int WaveformWidget::pushLiveFrames(const float *frames, int frameCount)
+{
+    /*the count is read first, so the input loaded is the one it published or a newer one*/
+    quint64 published = this->m_livePublished.load(std::memory_order_acquire);
+    LiveInput *input = this->m_liveInput.load(std::memory_order_acquire);
+    int accepted = 0;
+    if (input != NULL && frameCount > 0)
+    {
+        int channels = input->channels;
+        accepted = std::min(frameCount, (int) (input->buffer.writeAvailable() / channels));
+        input->buffer.write(frames, accepted * channels);
+
+        if (accepted < frameCount)
+        {
+            this->m_liveOverrunFrames.fetch_add(frameCount - accepted, std::memory_order_relaxed);
+            this->m_liveOverrunEvents.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    /*done with every input older than the one loaded*/
+    this->m_liveAcknowledged.store(published, std::memory_order_release);
+    return accepted;
+}
 
+/*!
+\brief Number of frames dropped by pushLiveFrames() because the ring buffer was full.
+*/
+quint64 WaveformWidget::liveOverrunFrames()
+{
+    return this->m_liveOverrunFrames.load(std::memory_order_relaxed);
+}
+
+/*!
+\brief Number of pushLiveFrames() calls that had to drop frames.
+*/
+quint64 WaveformWidget::liveOverrunEvents()
+{
+    return this->m_liveOverrunEvents.load(std::memory_order_relaxed);
+}
+
+/*
+    Runs on the live timer.  Empties the ring buffer and folds its frames into peak columns:
+    m_liveColumns is a circular history of one peak per channel for each pixel of the widget,
+    with m_liveColumnHead pointing at the oldest column.  The column being filled is kept in
+    m_liveCurrentPeak until it has received its share of frames.
+*/
+void WaveformWidget::drainLiveInput()
+{
+    this->freeRetiredLiveInputs();
+    LiveInput *input = this->m_liveInput.load();
+    if (input == NULL)
+        return;
+
+    int channels = this->m_liveChannels;
+    if (this->m_liveColumnCount != this->width())
+    {
+        this->m_liveColumnCount = std::max(1, this->width());
+        this->m_liveColumns.assign(this->m_liveColumnCount * channels, 0.0);
+        this->m_liveColumnHead = 0;
+        this->m_liveCurrentPeak.assign(channels, 0.0);
+        this->m_liveFramesInColumn = 0;
+    }
+    int framesPerColumn = std::max(1, (int) (this->m_liveWindowSeconds * this->m_liveSampleRate / this->m_liveColumnCount));
+
+    bool changed = false;
+    size_t samplesRead;
+    /* the producer only writes whole frames and the scratch holds whole frames, so every read ends on a frame boundary */
+    while ((samplesRead = input->buffer.read(this->m_liveScratch.data(), this->m_liveScratch.size())) > 0)
+    {
+        const float *frame = this->m_liveScratch.data();
+        for (size_t i = 0; i < samplesRead; i += channels, frame += channels)
+        {
+            for (int c = 0; c < channels; c++)
+                this->m_liveCurrentPeak[c] = std::max(this->m_liveCurrentPeak[c], (double) fabs(frame[c]));
+
+            if (++this->m_liveFramesInColumn == framesPerColumn)
+            {
+                for (int c = 0; c < channels; c++)
+                {
+                    this->m_liveColumns[this->m_liveColumnHead * channels + c] = this->m_liveCurrentPeak[c];
+                    this->m_liveCurrentPeak[c] = 0.0;
+                }
+                this->m_liveColumnHead = (this->m_liveColumnHead + 1) % this->m_liveColumnCount;
+                this->m_liveFramesInColumn = 0;
+                changed = true;
+            }
+        }
+    }
+
+    if (changed)
+        this->requestRedraw();
+}
+
+/*Draws the live column history, oldest on the left, with one lane per channel.*/
+void WaveformWidget::drawLiveColumns(const RenderState &state, QPainter &painter)
+{
+    int channels = state.liveChannels;
+    int columns = state.liveColumnCount;
+    if (columns == 0 || (int) state.liveColumns.size() < columns * channels)
+        return;
+
+    double laneHeight = (double) state.size.height() / channels;
+    double scale = 1.0 - state.padding;
+    painter.setPen(QPen(state.waveformColor, 1, Qt::SolidLine, Qt::RoundCap));
+
+    for (int x = 0; x < columns; x++)
+    {
+        int column = (state.liveColumnHead + x) % columns;
+        for (int c = 0; c < channels; c++)
+        {
+            double laneMidpoint = laneHeight * (c + 0.5);
+            double extent = (laneHeight / 2) * state.liveColumns[column * channels + c] * scale;
+            painter.drawLine(QPointF(x, laneMidpoint - extent), QPointF(x, laneMidpoint + extent));
+        }
+    }
 }
 
 /*!
@@ -391,6 +1676,7 @@ void WaveformWidget::overviewDraw()
 void WaveformWidget::setColor(QColor color)
 {
     this->m_waveformColor = color;
+    this->requestRedraw();
 }
 
 
@@ -400,5 +1686,6 @@ void WaveformWidget::resizeEvent(QResizeEvent *e)
     if (!m_isClickHold)
         m_shouldRecalculatePeaks = true;
     m_lastSize = e->size();
+    this->requestRedraw();
 }
 
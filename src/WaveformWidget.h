@@ -3,6 +3,9 @@
 
 #include "AudioUtil.h"
 #include "MathUtil.h"
+#include "RingBuffer.h"
+#include "AnalysisScheduler.h"
+#include "FrameClock.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,9 +26,12 @@
 #include <QProcess>
 #include <QFileInfo>
 #include <QMouseEvent>
-#include <QPixmap>
-#include <QLabel>
+#include <QImage>
 #include <QTimer>
+#include <QSharedPointer>
+#include <QByteArray>
+#include <QList>
+#include <QPointer>
 
 /*!
     \file WaveformWidget.h
@@ -49,8 +55,13 @@ public:
     WaveformWidget(QWidget *parent = nullptr);
     ~WaveformWidget();
     void setSource(QFileInfo *fileName);
+    static void setSources(const QList<WaveformWidget *> &widgets, const QList<QFileInfo> &files);
     void resetFile(QFileInfo *fileName);
-    enum FileHandlingMode {FULL_CACHE, DISK_MODE};
+    void setPeakSource(QFileInfo *peakFile);
+    void setPeakData(const QByteArray &peakData);
+    bool exportPeaks(QString filePath);
+    enum FileHandlingMode {FULL_CACHE, DISK_MODE, AUTO, PEAKS_ONLY};
+    enum RenderMode {PEAK_MODE, SPECTRAL_MODE};
     void setColor(QColor color);
     void setFileHandlingMode(FileHandlingMode mode);
     void setClickable(bool clickable);
@@ -58,30 +69,157 @@ public:
     void setBreakPoint(int pos);
     int getBreakPoint();
     FileHandlingMode getFileHandlingMode();
+    void setRenderMode(RenderMode mode);
+    RenderMode getRenderMode();
+    bool isLoading();
+    void setDeferredLoading(bool deferred);
+    bool isDeferredLoading();
+    void setReleaseDelay(int msecs);
+    int getReleaseDelay();
+    void setIOPolicy(const AudioUtil::IOPolicy &policy);
+    AudioUtil::IOPolicy getIOPolicy();
+    void setVisibleRange(int startFrame, int endFrame);
+    void resetVisibleRange();
+    int getVisibleStart();
+    int getVisibleEnd();
+    void startLiveInput(int channels, int sampleRate, double windowSeconds = 5.0, int bufferFrames = 65536);
+    void stopLiveInput();
+    bool isLive();
+    int pushLiveFrames(const float *frames, int frameCount);
+    quint64 liveOverrunFrames();
+    quint64 liveOverrunEvents();
 
 protected:
     virtual void resizeEvent(QResizeEvent *);
     void mouseMoveEvent(QMouseEvent *event) override;
     void mousePressEvent(QMouseEvent *event);
+    void showEvent(QShowEvent *event) override;
+    void hideEvent(QHideEvent *event) override;
+    void paintEvent(QPaintEvent *event) override;
+    void sliderChange(SliderChange change) override;
+    bool eventFilter(QObject *watched, QEvent *event) override;
 
 
 private:
-    AudioUtil *m_srcAudioFile;
+    QSharedPointer<AudioUtil> m_srcAudioFile;
+    QSharedPointer<AudioUtil> m_activeLoader;
+    int m_analysisPriority;
+    int m_loadGeneration;
+    bool m_isLoading;
+    bool m_deferredLoading;
+    bool m_loadPending;
+    QTimer *m_releaseTimer;
+    AudioUtil::IOPolicy m_ioPolicy;
+    /*the device the source is on, once setSources() has located it, for the scheduler's per-device limit*/
+    qint64 m_loadDevice;
+    bool m_batchLoad;
+    /*the frames spanned by the widget; an empty range means the whole file*/
+    int m_visibleStart;
+    int m_visibleEnd;
+    /*a set of peak columns: the frames they cover, the width they were computed for, and the render mode*/
+    struct PeakRange
+    {
+        int startFrame;
+        int endFrame;
+        int width;
+        int renderMode;
+        bool operator==(const PeakRange &other) const
+        {
+            return startFrame == other.startFrame && endFrame == other.endFrame && width == other.width && renderMode == other.renderMode;
+        }
+    };
+    struct PeakColumns
+    {
+        PeakRange range;
+        vector<double> peaks;
+        vector<double> bands;
+        double scaleFactor;
+    };
+    enum NavigationDirection {NO_DIRECTION, PAN_LEFT, PAN_RIGHT, ZOOM_IN, ZOOM_OUT};
+    /*recently computed and prefetched columns, most recently used first*/
+    QList<PeakColumns> m_peakCache;
+    QList<PeakRange> m_prefetchPending;
+    NavigationDirection m_navigationDirection;
+    std::atomic<int> m_prefetchGeneration;
+    /*prefetch jobs past their start; releaseMemory() waits for them to drain before dropping the cache*/
+    std::atomic<int> m_prefetchesRunning;
+    bool m_redrawRequired;
+    bool m_releasePending;
+    bool m_isLive;
+    /*the live ring buffer and the channel count of the frames in it, replaced together so the audio thread never sees one without the other*/
+    struct LiveInput
+    {
+        LiveInput(size_t capacity, int channels) : buffer(capacity), channels(channels) {}
+        RingBuffer<float> buffer;
+        int channels;
+    };
+    std::atomic<LiveInput*> m_liveInput;
+    /*bumped each time m_liveInput is replaced; each pushLiveFrames() echoes the count it started under*/
+    std::atomic<quint64> m_livePublished;
+    std::atomic<quint64> m_liveAcknowledged;
+    /*replaced inputs, with the count that replaced them; freed once the audio thread has acknowledged it*/
+    vector<std::pair<quint64, LiveInput*> > m_liveRetired;
+    int m_liveChannels;
+    int m_liveSampleRate;
+    double m_liveWindowSeconds;
+    QTimer *m_liveTimer;
+    vector<float> m_liveScratch;
+    vector<double> m_liveColumns;
+    int m_liveColumnHead;
+    int m_liveColumnCount;
+    vector<double> m_liveCurrentPeak;
+    int m_liveFramesInColumn;
+    std::atomic<quint64> m_liveOverrunFrames;
+    std::atomic<quint64> m_liveOverrunEvents;
     FileHandlingMode m_currentFileHandlingMode;
+    RenderMode m_renderMode;
     vector<double> m_peakVector;
+    vector<double> m_bandVector;
     vector<double> m_dataVector;
     QString m_audioFilePath;
+    QString m_peakFilePath;
+    QByteArray m_peakData;
     double m_padding;
     QSize m_lastSize;
     QColor m_waveformColor { Qt::blue };
     QColor m_progressColor { QColor(246, 134, 86) };
     QColor m_waveformBackgroundColor { Qt::transparent };
     double m_scaleFactor;
-    QPixmap m_pixMap;
-    QLabel *m_pixMapLabel;
+    /*everything the waveform image is drawn from, copied for the render thread*/
+    struct RenderState
+    {
+        QSize size;
+        qreal progress;
+        bool live;
+        bool placeholder;
+        bool hasFile;
+        int numChannels;
+        vector<double> peaks;
+        vector<double> bands;
+        double scaleFactor;
+        bool spectral;
+        QColor waveformColor;
+        QColor progressColor;
+        QColor backgroundColor;
+        int breakPointPos;
+        vector<double> liveColumns;
+        int liveColumnHead;
+        int liveColumnCount;
+        int liveChannels;
+        double padding;
+    };
+    /*the image shown by paintEvent(), and the one the next redraw is rasterized into*/
+    QImage m_frontImage;
+    QImage m_backImage;
+    bool m_isRendering;
+    int m_renderGeneration;
     bool m_is_clickable;
-    qreal m_lastDrawnValue;
-    QTimer *m_paintTimer;
+    /*the first column past the cursor in the last image drawn; the image only changes when this does*/
+    int m_lastDrawnColumn;
+    bool m_drawQueued;
+    int m_idleFrames;
+    /*the widget and its ancestors, whose moves and resizes may take it on or off screen*/
+    QList<QPointer<QWidget> > m_watchedWidgets;
     bool m_shouldRecalculatePeaks;
     bool m_isRecalculatingPeaks;
     bool m_isClickHold;
@@ -89,13 +227,50 @@ private:
     bool m_hasBreakPoint;
     int m_breakPointPos;
 
-    void recalculatePeaks();
+    int analysisPriority();
+    void updateAnalysisPriority();
+    bool hasSource();
+    bool isOnScreen();
+    void requestLoad();
+    void unloadSource();
+    void updateVisibility();
+    void releaseHidden();
+    void startLoad();
+    void prepareBatchSource(const QString &filePath);
+    void finishLoad(QSharedPointer<AudioUtil> loader, bool succeeded, int generation);
+    void cancelLoad();
+    void releaseMemory();
+    PeakRange visiblePeakRange() const;
+    bool findCachedPeaks(const PeakRange &range);
+    void cachePeaks(const PeakColumns &columns);
+    void clearPeakCache();
+    void prefetchAround(const PeakRange &range);
+    void cancelPrefetch();
+    qreal progressColumn();
+    void recalculatePeaks(QSharedPointer<AudioUtil> audioFile, PeakRange range, int generation, int prefetchGeneration);
+    void publishPeaks(PeakColumns columns, int generation, int prefetchGeneration);
+    static QColor columnColor(const RenderState &state, int column, bool played);
+    void publishLiveInput(LiveInput *input);
+    void freeRetiredLiveInputs();
+    void drainLiveInput();
+    static void drawLiveColumns(const RenderState &state, QPainter &painter);
+    RenderState renderState(qreal progress);
+    static void rasterize(const RenderState &state, QImage &image);
+    void publishImage(QImage image, int generation);
+    void clearImages();
     void overviewDraw();
+    void requestDraw();
+    void requestRedraw();
+    void frameTick();
+    void watchAncestors();
     int mouseEventPosition(const QMouseEvent *event) const;
 signals:
   void barClicked(int);
   void breakPointRemoved();
   int breakPointSet(int position);
+  void loadProgress(int percent);
+  void loaded();
+  void loadFailed();
 };
 
 #endif // WAVEFORMWIDGET_H
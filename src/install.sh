@@ -3,3 +3,8 @@ cp build/* /usr/lib/
 cp AudioUtil.h /usr/include/
 cp WaveformWidget.h /usr/include/
 cp MathUtil.h /usr/include/
+cp RingBuffer.h /usr/include/
+cp AnalysisScheduler.h /usr/include/
+cp PeakKernels.h /usr/include/
+cp SharedPeakStore.h /usr/include/
+cp FrameClock.h /usr/include/
@@ -3,3 +3,8 @@ rm /usr/lib/libwaveformwidget.so*
 rm /usr/include/MathUtil.h 
 rm /usr/include/AudioUtil.h 
 rm /usr/include/WaveformWidget.h
+rm /usr/include/RingBuffer.h
+rm /usr/include/AnalysisScheduler.h
+rm /usr/include/PeakKernels.h
+rm /usr/include/SharedPeakStore.h
+rm /usr/include/FrameClock.h